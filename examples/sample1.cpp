@@ -42,26 +42,10 @@ int main(int argc, char** argv)
 	for(auto it = out_begin; it != out_end; it++)
 		outputs.push_back(it->str());
 	
-	std::ifstream glslFile(*file, std::ios::in);
-	if(!glslFile.is_open())
-	{
-		std::cout << "failed to open file " << *file;
-		return -1;
-	}
-	
-	std::stringstream ss;
-	ss << glslFile.rdbuf();
-	std::unique_ptr<char[]> buffer = std::make_unique<char[]>(ss.str().size());
-	std::memcpy(buffer.get(), ss.str().c_str(), ss.str().size());
-	
-	molecular::programgenerator::ProgramFile programFile(buffer.get(), buffer.get() + ss.str().size());
+	// Parses imported files as well:
+	auto programFile = molecular::programgenerator::ProgramFileCache::GetInstance().Load(*file);
 	molecular::programgenerator::ProgramGenerator generator;
-
-	for(auto& variable: programFile.GetVariables())
-		generator.AddVariable(variable);
-	
-	for(auto& function: programFile.GetFunctions())
-		generator.AddFunction(function);
+	generator.AddProgramFile(*programFile);
 	
 	std::vector<molecular::util::Hash> variables;
 	for(const auto& in : inputs)
@@ -1,38 +1,4 @@
-vertex
-vec4 vertexPosition(attr vec4 vertexPositionAttr)
-{
-	vertexPosition = vertexPositionAttr;
-}
-
-vertex
-vec3 vertexNormal(attr vec3 vertexNormalAttr)
-{
-	vertexNormal = vertexNormalAttr;
-}
-
-vertex
-vec2 vertexUv0(attr vec2 vertexUv0Attr)
-{
-	vertexUv0 = vertexUv0Attr;
-}
-
-vertex
-vec3 vertexColor(attr vec3 vertexColorAttr)
-{
-	vertexColor = vertexColorAttr;
-}
-
-vertex
-vec3 normal(mat4 modelMatrix, vec3 vertexNormal)
-{
-	normal = normalize((modelMatrix * vec4(vertexNormal, 0.0)).xyz);
-}
-
-vertex
-mat4 modelViewMatrix(mat4 viewMatrix, mat4 modelMatrix)
-{
-	modelViewMatrix = viewMatrix * modelMatrix;
-}
+import "common.glsl"
 
 vertex
 out vec4 gl_Position(mat4 modelViewMatrix, mat4 projectionMatrix, vec4 vertexPosition)
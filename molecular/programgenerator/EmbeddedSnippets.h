@@ -0,0 +1,122 @@
+/*	EmbeddedSnippets.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_EMBEDDEDSNIPPETS_H
+#define MOLECULAR_EMBEDDEDSNIPPETS_H
+
+#include "ProgramGenerator.h"
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Variable of EmbeddedSnippets
+struct EmbeddedVariable
+{
+	ProgramGenerator::Variable hash;
+	const char* name;
+	const char* type;
+	ProgramGenerator::VariableInfo::Usage usage;
+	bool array;
+};
+
+/// Geometry shader setup of an EmbeddedFunction, see ProgramGenerator::GSInfo
+struct EmbeddedGSInfo
+{
+	const char* inPrimitive;
+	const char* outPrimitive;
+	size_t maxVertices;
+	size_t invocations;
+	const size_t* primitiveDescription;
+	size_t primitiveDescriptionCount;
+	bool autoEmission;
+};
+
+/// Tessellation setup of an EmbeddedFunction, see ProgramGenerator::TessInfo
+struct EmbeddedTessInfo
+{
+	size_t patchVertices;
+	const char* primitive;
+	const char* spacing;
+	const char* ordering;
+};
+
+/// Specialization of an EmbeddedFunction, see ProgramGenerator::Specialization
+struct EmbeddedSpecialization
+{
+	ProgramGenerator::Variable variable;
+	const char* value;
+};
+
+/// Function of EmbeddedSnippets, see ProgramGenerator::Snippet
+/** Cost, texture reads and calls are computed when the snippets are embedded. */
+struct EmbeddedFunction
+{
+	const char* name;
+	ProgramGenerator::Variable output;
+	ProgramGenerator::Variable outputArraySizeSource;
+	ProgramGenerator::Function::Stage stage;
+	int priority;
+	unsigned cost;
+	unsigned textureSamples;
+	bool highQuality;
+	bool pureFunction;
+	const ProgramGenerator::Variable* inputs;
+	size_t inputCount;
+	const char* const* sources;
+	size_t sourceCount;
+	const EmbeddedSpecialization* specializations;
+	size_t specializationCount;
+	const ProgramGenerator::Variable* calls;
+	size_t callCount;
+	/// nullptr if the function has no geometry shader setup
+	const EmbeddedGSInfo* gsInfo;
+	/// nullptr if the function has no tessellation setup
+	const EmbeddedTessInfo* tessInfo;
+};
+
+/// Snippet files compiled into the program
+/** Generated at build time by the molecular_embed_snippets() CMake function, which runs
+	tools/EmbedSnippets.cpp. All members are constant initialized, so the tables can be used
+	before main() and need no parsing or file access:
+	@code
+	#include "MySnippets.h" // Declares extern const EmbeddedSnippets MySnippets;
+	ProgramGenerator generator;
+	generator.AddEmbeddedSnippets(MySnippets);
+	@endcode */
+struct EmbeddedSnippets
+{
+	const EmbeddedVariable* variables;
+	size_t variableCount;
+	/// Grouped by output, in the order the functions were added
+	const EmbeddedFunction* functions;
+	size_t functionCount;
+};
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_EMBEDDEDSNIPPETS_H
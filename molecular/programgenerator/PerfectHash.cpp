@@ -0,0 +1,113 @@
+/*	PerfectHash.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "PerfectHash.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+static uint32_t NextPowerOfTwo(size_t value)
+{
+	uint32_t result = 1;
+	while(result < value)
+		result <<= 1;
+	return result;
+}
+
+void PerfectHash::Build(const std::vector<util::Hash>& keys)
+{
+	mSize = keys.size();
+	mSeeds.clear();
+	mSlots.clear();
+	if(keys.empty())
+		return;
+
+	// Load factor of at most 0.5 keeps the seed search short
+	uint32_t bucketCount = NextPowerOfTwo(std::max<size_t>(1, keys.size() / 4));
+	uint32_t slotCount = NextPowerOfTwo(keys.size() * 2);
+	mBucketMask = bucketCount - 1;
+	mSlotMask = slotCount - 1;
+
+	std::vector<std::vector<uint32_t>> buckets(bucketCount);
+	for(uint32_t i = 0; i < keys.size(); i++)
+		buckets[Bucket(keys[i])].push_back(i);
+
+	// Place large buckets first, while there is still a lot of room
+	std::vector<uint32_t> order(bucketCount);
+	for(uint32_t i = 0; i < bucketCount; i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){return buckets[a].size() > buckets[b].size();});
+
+	mSeeds.assign(bucketCount, 0);
+	mSlots.assign(slotCount, Slot{0, kNotFound});
+	std::vector<uint32_t> bucketSlots;
+	for(uint32_t bucket: order)
+	{
+		const std::vector<uint32_t>& members = buckets[bucket];
+		if(members.empty())
+			break;
+
+		for(uint32_t seed = 0; ; seed++)
+		{
+			if(seed == 0x100000)
+				throw std::runtime_error("Cannot build perfect hash table");
+
+			bool fits = true;
+			bucketSlots.clear();
+			for(uint32_t member: members)
+			{
+				uint32_t slot = SlotIndex(keys[member], seed);
+				if(mSlots[slot].index != kNotFound || std::find(bucketSlots.begin(), bucketSlots.end(), slot) != bucketSlots.end())
+				{
+					// Two identical keys can never be separated:
+					for(uint32_t other: members)
+					{
+						if(other != member && keys[other] == keys[member])
+							throw std::invalid_argument("Duplicate key " + std::to_string(keys[member]) + " in perfect hash table");
+					}
+					fits = false;
+					break;
+				}
+				bucketSlots.push_back(slot);
+			}
+
+			if(fits)
+			{
+				mSeeds[bucket] = seed;
+				for(size_t i = 0; i < members.size(); i++)
+					mSlots[bucketSlots[i]] = Slot{keys[members[i]], members[i]};
+				break;
+			}
+		}
+	}
+}
+
+}
+} // namespace molecular
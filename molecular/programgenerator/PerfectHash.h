@@ -0,0 +1,96 @@
+/*	PerfectHash.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_PERFECTHASH_H
+#define MOLECULAR_PERFECTHASH_H
+
+#include <vector>
+#include <cstdint>
+#include <molecular/util/Hash.h>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Collision free mapping from a fixed set of hashes to dense indices
+/** Uses "hash and displace": keys are distributed into buckets, and each bucket gets a seed
+	that places all of its keys into distinct slots. A lookup reads one seed and one slot, with
+	no probing and no chaining. Keys that were not part of the set are rejected by comparing
+	against the key stored in the slot. */
+class PerfectHash
+{
+public:
+	static const uint32_t kNotFound = 0xffffffff;
+
+	/// Build the table for the given keys
+	/** The index of a key is its position in the vector.
+		@throws std::invalid_argument if a key occurs twice. */
+	void Build(const std::vector<util::Hash>& keys);
+
+	/// Get the index of a key, or kNotFound
+	uint32_t Find(util::Hash key) const
+	{
+		if(mSlots.empty())
+			return kNotFound;
+		uint32_t seed = mSeeds[Bucket(key)];
+		const Slot& slot = mSlots[SlotIndex(key, seed)];
+		return (slot.index != kNotFound && slot.key == key) ? slot.index : kNotFound;
+	}
+
+	size_t GetSize() const {return mSize;}
+
+private:
+	struct Slot
+	{
+		util::Hash key;
+		uint32_t index;
+	};
+
+	static uint32_t Mix(uint32_t x)
+	{
+		// Finalizer of MurmurHash3
+		x ^= x >> 16;
+		x *= 0x85ebca6b;
+		x ^= x >> 13;
+		x *= 0xc2b2ae35;
+		x ^= x >> 16;
+		return x;
+	}
+
+	uint32_t Bucket(util::Hash key) const {return Mix(key) & mBucketMask;}
+	uint32_t SlotIndex(util::Hash key, uint32_t seed) const {return Mix(key ^ (seed * 0x9e3779b9)) & mSlotMask;}
+
+	std::vector<uint32_t> mSeeds;
+	std::vector<Slot> mSlots;
+	uint32_t mBucketMask = 0;
+	uint32_t mSlotMask = 0;
+	size_t mSize = 0;
+};
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_PERFECTHASH_H
@@ -0,0 +1,353 @@
+/*	ProgramCache.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "ProgramCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Start of a cache file, followed by a 32 bit version
+static const char kFileMagic[8] = {'M', 'O', 'L', 'P', 'G', 'C', 'A', 'C'};
+static const uint32_t kFileVersion = 1;
+static const size_t kFileHeaderSize = sizeof(kFileMagic) + 4;
+/// Start of each entry, followed by key size, value size (32 bit each) and checksum (64 bit)
+static const uint32_t kEntryMagic = 0x454e5452;
+static const size_t kEntryHeaderSize = 20;
+
+static uint64_t Fnv1a(const std::string& data, uint64_t hash = 14695981039346656037ull)
+{
+	for(char c: data)
+		hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+	return hash;
+}
+
+static uint64_t Checksum(const std::string& key, const std::string& value)
+{
+	return Fnv1a(value, Fnv1a(key));
+}
+
+static void PutInteger(char* data, uint64_t value, size_t size)
+{
+	for(size_t i = 0; i < size; i++)
+		data[i] = static_cast<char>(value >> (i * 8));
+}
+
+static uint64_t GetInteger(const char* data, size_t size)
+{
+	uint64_t value = 0;
+	for(size_t i = 0; i < size; i++)
+		value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (i * 8);
+	return value;
+}
+
+ProgramCache::ProgramCache(const std::string& path, uint64_t maxSize) :
+	mPath(path),
+	mMaxSize(maxSize)
+{
+	Lock();
+	try
+	{
+		Load();
+	}
+	catch(...)
+	{
+		Unlock();
+		throw;
+	}
+}
+
+ProgramCache::~ProgramCache()
+{
+	mFile.close();
+	Unlock();
+}
+
+bool ProgramCache::Find(const std::string& key, std::string& value)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mEntries.find(Fnv1a(key));
+	if(it == mEntries.end())
+		return false;
+
+	std::string storedKey;
+	if(!Read(it->second, storedKey, value) || storedKey != key)
+	{
+		value.clear();
+		return false;
+	}
+	it->second.lastUse = ++mUseCounter;
+	return true;
+}
+
+void ProgramCache::Insert(const std::string& key, const std::string& value)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	const uint64_t size = kEntryHeaderSize + key.size() + value.size();
+	if(size > mMaxSize / 2)
+		return; // Would not survive the next compaction
+
+	mFile.clear();
+	mFile.seekp(mFileSize);
+	Write(mFile, key, value);
+	mFile.flush();
+	if(!mFile)
+		throw std::runtime_error("Cannot write program cache \"" + mPath + "\"");
+
+	Entry entry = {mFileSize, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()), ++mUseCounter};
+	mEntries[Fnv1a(key)] = entry;
+	mFileSize += size;
+	if(mFileSize > mMaxSize)
+		Compact(mMaxSize / 2);
+}
+
+void ProgramCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Reset();
+}
+
+size_t ProgramCache::GetEntryCount() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mEntries.size();
+}
+
+uint64_t ProgramCache::GetFileSize() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mFileSize;
+}
+
+void ProgramCache::Lock()
+{
+	// The cache file itself is replaced by Compact(), so a lock on it would not last
+	const std::string lockPath = mPath + ".lock";
+#ifdef _WIN32
+	HANDLE file = CreateFileA(lockPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Cannot create program cache lock \"" + lockPath + "\"");
+	OVERLAPPED overlapped = {};
+	if(!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped))
+	{
+		CloseHandle(file);
+		throw std::runtime_error("Program cache \"" + mPath + "\" is already in use");
+	}
+#else
+	int file = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if(file < 0)
+		throw std::runtime_error("Cannot create program cache lock \"" + lockPath + "\"");
+	if(flock(file, LOCK_EX | LOCK_NB) != 0)
+	{
+		close(file);
+		throw std::runtime_error("Program cache \"" + mPath + "\" is already in use");
+	}
+#endif
+	mLock = file;
+}
+
+void ProgramCache::Unlock()
+{
+	// Closing the file releases the lock
+#ifdef _WIN32
+	if(mLock)
+		CloseHandle(mLock);
+	mLock = nullptr;
+#else
+	if(mLock >= 0)
+		close(mLock);
+	mLock = -1;
+#endif
+}
+
+void ProgramCache::Load()
+{
+	mFile.open(mPath, std::ios::in | std::ios::out | std::ios::binary);
+	char header[kFileHeaderSize];
+	if(!mFile || !mFile.read(header, kFileHeaderSize)
+			|| std::memcmp(header, kFileMagic, sizeof(kFileMagic)) != 0
+			|| GetInteger(header + sizeof(kFileMagic), 4) != kFileVersion)
+	{
+		Reset();
+		return;
+	}
+
+	mFile.seekg(0, std::ios::end);
+	const uint64_t fileSize = mFile.tellg();
+	uint64_t offset = kFileHeaderSize;
+	uint64_t usedSize = kFileHeaderSize;
+	std::string key, value;
+	while(offset < fileSize)
+	{
+		char entryHeader[kEntryHeaderSize];
+		mFile.seekg(offset);
+		if(!mFile.read(entryHeader, kEntryHeaderSize) || GetInteger(entryHeader, 4) != kEntryMagic)
+			break;
+		Entry entry = {offset, static_cast<uint32_t>(GetInteger(entryHeader + 4, 4)), static_cast<uint32_t>(GetInteger(entryHeader + 8, 4)), 0};
+		const uint64_t size = kEntryHeaderSize + entry.keySize + entry.valueSize;
+		if(size > fileSize - offset || !Read(entry, key, value))
+			break;
+
+		// Later entries replace earlier ones with the same key
+		entry.lastUse = ++mUseCounter;
+		auto inserted = mEntries.insert(std::make_pair(Fnv1a(key), entry));
+		if(!inserted.second)
+		{
+			usedSize -= kEntryHeaderSize + inserted.first->second.keySize + inserted.first->second.valueSize;
+			inserted.first->second = entry;
+		}
+		usedSize += size;
+		offset += size;
+	}
+	mFileSize = offset;
+
+	// Drop invalid data at the end, and replaced entries
+	if(offset != fileSize || usedSize != fileSize || mFileSize > mMaxSize)
+		Compact(std::min(mMaxSize / 2, usedSize));
+}
+
+void ProgramCache::Reset()
+{
+	mFile.close();
+	mEntries.clear();
+	{
+		std::ofstream file(mPath, std::ios::out | std::ios::binary | std::ios::trunc);
+		char header[kFileHeaderSize];
+		std::memcpy(header, kFileMagic, sizeof(kFileMagic));
+		PutInteger(header + sizeof(kFileMagic), kFileVersion, 4);
+		file.write(header, kFileHeaderSize);
+		if(!file)
+			throw std::runtime_error("Cannot create program cache \"" + mPath + "\"");
+	}
+	mFile.open(mPath, std::ios::in | std::ios::out | std::ios::binary);
+	if(!mFile)
+		throw std::runtime_error("Cannot open program cache \"" + mPath + "\"");
+	mFileSize = kFileHeaderSize;
+}
+
+void ProgramCache::Compact(uint64_t size)
+{
+	std::vector<std::pair<uint64_t, Entry>> entries(mEntries.begin(), mEntries.end());
+	std::sort(entries.begin(), entries.end(), [](const std::pair<uint64_t, Entry>& a, const std::pair<uint64_t, Entry>& b){
+		return a.second.lastUse > b.second.lastUse;
+	});
+
+	// Write the new file next to the old one, then replace it:
+	const std::string newPath = mPath + ".new";
+	std::unordered_map<uint64_t, Entry> newEntries;
+	uint64_t newSize = kFileHeaderSize;
+	{
+		std::ofstream file(newPath, std::ios::out | std::ios::binary | std::ios::trunc);
+		char header[kFileHeaderSize];
+		std::memcpy(header, kFileMagic, sizeof(kFileMagic));
+		PutInteger(header + sizeof(kFileMagic), kFileVersion, 4);
+		file.write(header, kFileHeaderSize);
+
+		std::string key, value;
+		for(auto& it: entries)
+		{
+			const uint64_t entrySize = kEntryHeaderSize + it.second.keySize + it.second.valueSize;
+			if(newSize + entrySize > size)
+				continue; // Smaller, less recently used entries may still fit
+			if(!Read(it.second, key, value))
+				continue;
+			Write(file, key, value);
+			Entry entry = it.second;
+			entry.offset = newSize;
+			newEntries[it.first] = entry;
+			newSize += entrySize;
+		}
+		file.flush();
+		if(!file)
+			throw std::runtime_error("Cannot write program cache \"" + newPath + "\"");
+	}
+
+	mFile.close();
+	if(std::rename(newPath.c_str(), mPath.c_str()) != 0)
+	{
+		// Windows does not replace existing files
+		std::remove(mPath.c_str());
+		if(std::rename(newPath.c_str(), mPath.c_str()) != 0)
+		{
+			Reset();
+			return;
+		}
+	}
+	mFile.open(mPath, std::ios::in | std::ios::out | std::ios::binary);
+	if(!mFile)
+		throw std::runtime_error("Cannot open program cache \"" + mPath + "\"");
+	mEntries = std::move(newEntries);
+	mFileSize = newSize;
+}
+
+bool ProgramCache::Read(const Entry& entry, std::string& key, std::string& value)
+{
+	char header[kEntryHeaderSize];
+	mFile.clear();
+	mFile.seekg(entry.offset);
+	if(!mFile.read(header, kEntryHeaderSize)
+			|| GetInteger(header, 4) != kEntryMagic
+			|| GetInteger(header + 4, 4) != entry.keySize
+			|| GetInteger(header + 8, 4) != entry.valueSize)
+		return false;
+
+	key.resize(entry.keySize);
+	value.resize(entry.valueSize);
+	if(!mFile.read(&key[0], key.size()) || !mFile.read(&value[0], value.size()))
+		return false;
+	return GetInteger(header + 12, 8) == Checksum(key, value);
+}
+
+void ProgramCache::Write(std::ostream& stream, const std::string& key, const std::string& value)
+{
+	char header[kEntryHeaderSize];
+	PutInteger(header, kEntryMagic, 4);
+	PutInteger(header + 4, key.size(), 4);
+	PutInteger(header + 8, value.size(), 4);
+	PutInteger(header + 12, Checksum(key, value), 8);
+	stream.write(header, kEntryHeaderSize);
+	stream.write(key.data(), key.size());
+	stream.write(value.data(), value.size());
+}
+
+}
+} // namespace molecular
@@ -0,0 +1,124 @@
+/*	ProgramCache.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_PROGRAMCACHE_H
+#define MOLECULAR_PROGRAMCACHE_H
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Persistent cache of generated programs, see ProgramGenerator::SetProgramCache()
+/** Entries are appended to one file, each with a checksum. Opening the file scans it once to
+	build an index in memory. A partially written entry at the end, e.g. after a crash of the
+	process, is discarded. When the file grows beyond its maximum size, the most recently used
+	entries are copied to a new file until half of the maximum size is used, and the new file
+	replaces the old one. Writes are not synced to disk, so a power loss can lose recent
+	entries or, during compaction, the whole cache. Checksums keep damaged entries from being
+	used.
+
+	Thread safe. While a cache is open, it holds an exclusive lock on a file next to it with
+	the suffix ".lock", so other processes cannot open the same cache. */
+class ProgramCache
+{
+public:
+	/// Open or create a cache file
+	/** A file that is not a cache file of this version is replaced.
+		@throws std::runtime_error if the file cannot be created, or if it is open in another
+		ProgramCache, also of another process. Generators can then run without a cache. */
+	explicit ProgramCache(const std::string& path, uint64_t maxSize = kDefaultMaxSize);
+	~ProgramCache();
+	ProgramCache(const ProgramCache&) = delete;
+	ProgramCache& operator=(const ProgramCache&) = delete;
+
+	/// Look up the value of a key
+	/** @return false if the key is not cached. */
+	bool Find(const std::string& key, std::string& value);
+
+	/// Store a value, replacing an older value of the same key
+	/** @throws std::runtime_error if the file cannot be written. */
+	void Insert(const std::string& key, const std::string& value);
+
+	/// Remove all entries
+	void Clear();
+
+	size_t GetEntryCount() const;
+	uint64_t GetFileSize() const;
+
+	static const uint64_t kDefaultMaxSize = 64 << 20;
+
+private:
+	struct Entry
+	{
+		/// Offset of the entry header in the file
+		uint64_t offset;
+		uint32_t keySize;
+		uint32_t valueSize;
+		/// Value of mUseCounter when last inserted or found
+		uint64_t lastUse;
+	};
+
+	/// Take the lock file of the cache, see ProgramCache
+	void Lock();
+	void Unlock();
+	/// Read entries up to the first invalid one, then rewrite the file if it had invalid data
+	void Load();
+	/// Start a new file containing only the header
+	void Reset();
+	/// Rewrite the file with the most recently used entries that fit into size
+	void Compact(uint64_t size);
+	/// Read key and value of an entry, verifying its checksum
+	bool Read(const Entry& entry, std::string& key, std::string& value);
+	/// Append an entry to a stream
+	static void Write(std::ostream& stream, const std::string& key, const std::string& value);
+
+	const std::string mPath;
+	const uint64_t mMaxSize;
+	mutable std::mutex mMutex;
+	std::fstream mFile;
+	uint64_t mFileSize = 0;
+	/// Entries by hash of the key
+	std::unordered_map<uint64_t, Entry> mEntries;
+	uint64_t mUseCounter = 0;
+#ifdef _WIN32
+	/// Handle of the lock file
+	void* mLock = nullptr;
+#else
+	/// Descriptor of the lock file
+	int mLock = -1;
+#endif
+};
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_PROGRAMCACHE_H
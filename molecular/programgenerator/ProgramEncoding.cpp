@@ -0,0 +1,191 @@
+/*	ProgramEncoding.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "ProgramEncoding.h"
+#include <algorithm>
+
+namespace molecular
+{
+namespace programgenerator
+{
+namespace encoding
+{
+
+namespace
+{
+
+template<class Map>
+std::vector<typename Map::const_iterator> Sorted(const Map& map)
+{
+	std::vector<typename Map::const_iterator> sorted;
+	for(auto it = map.begin(); it != map.end(); ++it)
+		sorted.push_back(it);
+	std::sort(sorted.begin(), sorted.end(), [](typename Map::const_iterator a, typename Map::const_iterator b){return a->first < b->first;});
+	return sorted;
+}
+
+/// Shaders of ProgramText in pipeline order
+std::string ProgramGenerator::ProgramText::* const kShaders[] = {
+	&ProgramGenerator::ProgramText::vertexShader,
+	&ProgramGenerator::ProgramText::tessControlShader,
+	&ProgramGenerator::ProgramText::tessEvaluationShader,
+	&ProgramGenerator::ProgramText::geometryShader,
+	&ProgramGenerator::ProgramText::fragmentShader
+};
+
+/// Lists of Reflection in declaration order
+std::vector<ProgramGenerator::ReflectedVariable> ProgramGenerator::Reflection::* const kReflectionLists[] = {
+	&ProgramGenerator::Reflection::attributes,
+	&ProgramGenerator::Reflection::uniforms,
+	&ProgramGenerator::Reflection::samplers,
+	&ProgramGenerator::Reflection::varyings,
+	&ProgramGenerator::Reflection::outputs
+};
+
+void WriteReflection(Writer& writer, const ProgramGenerator::Reflection& reflection)
+{
+	for(auto list: kReflectionLists)
+	{
+		writer.Integer(static_cast<uint32_t>((reflection.*list).size()));
+		for(auto& variable: reflection.*list)
+		{
+			writer.Variable(variable.variable);
+			writer.String(variable.name);
+			writer.String(variable.type);
+			writer.Integer(static_cast<uint32_t>(variable.arraySize));
+			writer.Integer(static_cast<uint32_t>(variable.location));
+			writer.Byte(static_cast<uint8_t>(variable.stage));
+		}
+	}
+}
+
+void ReadReflection(Reader& reader, ProgramGenerator::Reflection& reflection)
+{
+	for(auto list: kReflectionLists)
+	{
+		for(uint32_t i = reader.Count(25); i > 0; i--)
+		{
+			ProgramGenerator::ReflectedVariable variable;
+			variable.variable = reader.Variable();
+			variable.name = reader.String();
+			variable.type = reader.String();
+			variable.arraySize = static_cast<int>(reader.Integer());
+			variable.location = static_cast<int>(reader.Integer());
+			variable.stage = static_cast<ProgramGenerator::Function::Stage>(reader.Byte());
+			(reflection.*list).push_back(std::move(variable));
+		}
+	}
+}
+
+} // namespace
+
+void WriteRequest(Writer& writer,
+		const std::set<ProgramGenerator::Variable>& inputs,
+		const std::set<ProgramGenerator::Variable>& outputs,
+		const std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
+		bool highQuality,
+		const ProgramGenerator::Constants& constants)
+{
+	writer.Byte(highQuality ? 1 : 0);
+	writer.Integer(static_cast<uint32_t>(inputs.size()));
+	for(auto it: inputs)
+		writer.Variable(it);
+	writer.Integer(static_cast<uint32_t>(outputs.size()));
+	for(auto it: outputs)
+		writer.Variable(it);
+	writer.Integer(static_cast<uint32_t>(arraySizes.size()));
+	for(auto it: Sorted(arraySizes))
+	{
+		writer.Variable(it->first);
+		writer.Integer(static_cast<uint32_t>(it->second));
+	}
+	writer.Integer(static_cast<uint32_t>(constants.size()));
+	for(auto it: Sorted(constants))
+	{
+		writer.Variable(it->first);
+		writer.String(it->second);
+	}
+}
+
+void ReadRequest(Reader& reader,
+		std::set<ProgramGenerator::Variable>& inputs,
+		std::set<ProgramGenerator::Variable>& outputs,
+		std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
+		bool& highQuality,
+		ProgramGenerator::Constants& constants)
+{
+	highQuality = reader.Byte() & 1;
+	for(uint32_t i = reader.Count(8); i > 0; i--)
+		inputs.insert(reader.Variable());
+	for(uint32_t i = reader.Count(8); i > 0; i--)
+		outputs.insert(reader.Variable());
+	for(uint32_t i = reader.Count(12); i > 0; i--)
+	{
+		ProgramGenerator::Variable variable = reader.Variable();
+		arraySizes[variable] = static_cast<int>(reader.Integer());
+	}
+	for(uint32_t i = reader.Count(12); i > 0; i--)
+	{
+		ProgramGenerator::Variable variable = reader.Variable();
+		constants[variable] = reader.String();
+	}
+}
+
+void WriteProgram(Writer& writer, const ProgramGenerator::ProgramText& text)
+{
+	for(auto shader: kShaders)
+		writer.String(text.*shader);
+	WriteReflection(writer, text.reflection);
+}
+
+void ReadProgram(Reader& reader, ProgramGenerator::ProgramText& text)
+{
+	for(auto shader: kShaders)
+		text.*shader = reader.String();
+	ReadReflection(reader, text.reflection);
+}
+
+std::string EncodeProgram(const ProgramGenerator::ProgramText& text)
+{
+	Writer writer;
+	writer.Byte(kVersion);
+	WriteProgram(writer, text);
+	return std::move(writer.Data());
+}
+
+ProgramGenerator::ProgramText DecodeProgram(const std::string& payload)
+{
+	Reader reader(payload);
+	if(reader.Byte() != kVersion)
+		throw std::runtime_error("Unsupported encoding version");
+	ProgramGenerator::ProgramText text;
+	ReadProgram(reader, text);
+	reader.Finish();
+	return text;
+}
+
+}
+}
+} // namespace molecular
@@ -0,0 +1,182 @@
+/*	ProgramEncoding.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_PROGRAMENCODING_H
+#define MOLECULAR_PROGRAMENCODING_H
+
+#include "ProgramGenerator.h"
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Canonical binary encoding of program requests and generated programs
+/** Used for the keys and values of ProgramCache, and for the messages of ServerProtocol.h.
+	Integers are little endian, variables are written as 64 bit hashes, strings as a 32 bit
+	size followed by the characters.
+	@code
+	request = flags (8 bit, bit 0: high quality),
+		input count (32 bit), {variable}, output count (32 bit), {variable},
+		array size count (32 bit), {variable, size (32 bit)},
+		constant count (32 bit), {variable, string} ;
+	program = vertex, tess control, tess evaluation, geometry, fragment shader, reflection ;
+	reflection = 5 * (count (32 bit), {variable, name, type, array size (32 bit), location (32 bit), stage (8 bit)}) ; (* attributes, uniforms, samplers, varyings, outputs *)
+	@endcode
+	Array sizes and constants are written sorted by variable, so equal requests are encoded
+	to equal bytes. Changes of the encoding must raise kVersion, and protocol::kVersion. */
+namespace encoding
+{
+
+static const uint8_t kVersion = 1;
+
+/// Appends encoded values to a string
+class Writer
+{
+public:
+	void Byte(uint8_t value) {mData.push_back(static_cast<char>(value));}
+
+	void Integer(uint32_t value)
+	{
+		for(int i = 0; i < 4; i++)
+			Byte(static_cast<uint8_t>(value >> (i * 8)));
+	}
+
+	void Variable(ProgramGenerator::Variable variable)
+	{
+		uint64_t value = variable;
+		for(int i = 0; i < 8; i++)
+			Byte(static_cast<uint8_t>(value >> (i * 8)));
+	}
+
+	void String(const std::string& string)
+	{
+		Integer(static_cast<uint32_t>(string.size()));
+		mData += string;
+	}
+
+	std::string& Data() {return mData;}
+
+private:
+	std::string mData;
+};
+
+/// Reads encoded values from a string, throwing std::runtime_error on truncated data
+class Reader
+{
+public:
+	explicit Reader(const std::string& data) : mData(data) {}
+
+	uint8_t Byte()
+	{
+		Require(1);
+		return static_cast<uint8_t>(mData[mPosition++]);
+	}
+
+	uint32_t Integer()
+	{
+		Require(4);
+		uint32_t value = 0;
+		for(int i = 0; i < 4; i++)
+			value |= static_cast<uint32_t>(Byte()) << (i * 8);
+		return value;
+	}
+
+	ProgramGenerator::Variable Variable()
+	{
+		Require(8);
+		uint64_t value = 0;
+		for(int i = 0; i < 8; i++)
+			value |= static_cast<uint64_t>(Byte()) << (i * 8);
+		return static_cast<ProgramGenerator::Variable>(value);
+	}
+
+	std::string String()
+	{
+		uint32_t size = Integer();
+		Require(size);
+		std::string string = mData.substr(mPosition, size);
+		mPosition += size;
+		return string;
+	}
+
+	/// Number of elements that follows, checked against the remaining size
+	uint32_t Count(size_t elementSize)
+	{
+		uint32_t count = Integer();
+		Require(static_cast<size_t>(count) * elementSize);
+		return count;
+	}
+
+	void Finish() const
+	{
+		if(mPosition != mData.size())
+			throw std::runtime_error("Trailing data in message");
+	}
+
+private:
+	void Require(size_t size) const
+	{
+		if(mData.size() - mPosition < size)
+			throw std::runtime_error("Truncated message");
+	}
+
+	const std::string& mData;
+	size_t mPosition = 0;
+};
+
+void WriteRequest(Writer& writer,
+		const std::set<ProgramGenerator::Variable>& inputs,
+		const std::set<ProgramGenerator::Variable>& outputs,
+		const std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
+		bool highQuality,
+		const ProgramGenerator::Constants& constants);
+/// @throws std::runtime_error if the data is malformed.
+void ReadRequest(Reader& reader,
+		std::set<ProgramGenerator::Variable>& inputs,
+		std::set<ProgramGenerator::Variable>& outputs,
+		std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
+		bool& highQuality,
+		ProgramGenerator::Constants& constants);
+
+/// Write the stage texts and reflection of a program
+void WriteProgram(Writer& writer, const ProgramGenerator::ProgramText& text);
+/// @throws std::runtime_error if the data is malformed.
+void ReadProgram(Reader& reader, ProgramGenerator::ProgramText& text);
+
+/// Encode a program with kVersion, e.g. for ProgramCache
+std::string EncodeProgram(const ProgramGenerator::ProgramText& text);
+/// @throws std::runtime_error if the payload is malformed or of another version.
+ProgramGenerator::ProgramText DecodeProgram(const std::string& payload);
+
+}
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_PROGRAMENCODING_H
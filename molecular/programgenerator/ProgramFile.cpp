@@ -29,6 +29,25 @@ SOFTWARE.
 #include <iostream>
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <climits>
+#ifdef _WIN32
+#include <stdlib.h>
+#else
+#include <limits.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MOLECULAR_PROGRAMFILE_SSE2 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace molecular
 {
 namespace programgenerator
@@ -36,29 +55,272 @@ namespace programgenerator
 using namespace util;
 using namespace util::Parser;
 
+namespace
+{
+
+typedef Concatenation<Alpha, Repetition<Alternation<Alpha, Digit, Char<'_'>> > > Identifier;
+
+/// Matches a fixed string
+/** Compares against a flat character array instead of nesting one Char<> parser per character. */
+template<char... characters>
+class Keyword
+{
+public:
+	template<class Iterator>
+	static bool Parse(Iterator& begin, Iterator end, void*)
+	{
+		static const char text[] = {characters...};
+		Iterator it = begin;
+		for(char c: text)
+		{
+			if(it == end || *it != c)
+				return false;
+			++it;
+		}
+		begin = it;
+		return true;
+	}
+};
+
+/// Text up to the next double quote on the same line, which is not consumed
+class QuotedText
+{
+public:
+	template<class Iterator>
+	static bool Parse(Iterator& begin, Iterator end, void*)
+	{
+		Iterator it = begin;
+		while(it != end && *it != '"' && *it != '\n')
+			++it;
+		if(it == begin || it == end || *it != '"')
+			return false;
+		begin = it;
+		return true;
+	}
+};
+
+/// Text up to the next whitespace, at least one character
+class Word
+{
+public:
+	template<class Iterator>
+	static bool Parse(Iterator& begin, Iterator end, void*)
+	{
+		Iterator it = begin;
+		while(it != end && !isspace(static_cast<unsigned char>(*it)))
+			++it;
+		if(it == begin)
+			return false;
+		begin = it;
+		return true;
+	}
+};
+
+inline unsigned CountTrailingZeros(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+inline bool IsBodySpecial(char c)
+{
+	return c == '{' || c == '}' || c == '/' || c == '"';
+}
+
+/// Find the next character that is relevant for brace matching: '{', '}', '/' or '"'
+/** Uses SSE2 to test 16 bytes at a time if available, otherwise 8 bytes at a time in a
+	general purpose register. */
+char* FindBodySpecial(char* begin, char* end)
+{
+#ifdef MOLECULAR_PROGRAMFILE_SSE2
+	const __m128i openBrace = _mm_set1_epi8('{');
+	const __m128i closeBrace = _mm_set1_epi8('}');
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i quote = _mm_set1_epi8('"');
+	while(end - begin >= 16)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		__m128i braces = _mm_or_si128(_mm_cmpeq_epi8(chunk, openBrace), _mm_cmpeq_epi8(chunk, closeBrace));
+		__m128i others = _mm_or_si128(_mm_cmpeq_epi8(chunk, slash), _mm_cmpeq_epi8(chunk, quote));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(braces, others)));
+		if(mask)
+			return begin + CountTrailingZeros(mask);
+		begin += 16;
+	}
+#else
+	const uint64_t ones = 0x0101010101010101ull;
+	const uint64_t highBits = 0x8080808080808080ull;
+	while(end - begin >= 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, begin, 8);
+		uint64_t found = 0;
+		for(char c: {'{', '}', '/', '"'})
+		{
+			// Classic "has zero byte" test on the XOR with the searched character
+			uint64_t v = word ^ (ones * static_cast<unsigned char>(c));
+			found |= (v - ones) & ~v & highBits;
+		}
+		if(found)
+			break; // Exact position is determined below
+		begin += 8;
+	}
+#endif
+	while(begin != end && !IsBodySpecial(*begin))
+		++begin;
+	return begin;
+}
+
+} // namespace
+
+bool ProgramFile::Body::Parse(char*& begin, char* end, void*)
+{
+	if(begin == end)
+		return false;
+
+	int parensCount = 1;
+	char* it = begin;
+	while(true)
+	{
+		it = FindBodySpecial(it, end);
+		if(it == end)
+			return false;
+
+		switch(*it)
+		{
+		case '{':
+			parensCount++;
+			break;
+
+		case '}':
+			parensCount--;
+			if(parensCount == 0)
+			{
+				// Keep surrounding closing bracket in buffer:
+				begin = it;
+				return true;
+			}
+			break;
+
+		case '/':
+			if(end - it >= 2 && it[1] == '/')
+			{
+				// Line comment: continue at the line break
+				char* lineEnd = static_cast<char*>(std::memchr(it + 2, '\n', end - it - 2));
+				if(!lineEnd)
+					return false;
+				it = lineEnd;
+			}
+			else if(end - it >= 2 && it[1] == '*')
+			{
+				// Block comment: continue at the closing "*/"
+				char* star = it + 2;
+				while(true)
+				{
+					star = static_cast<char*>(std::memchr(star, '*', end - star));
+					if(!star || end - star < 2)
+						return false;
+					if(star[1] == '/')
+						break;
+					star++;
+				}
+				it = star + 1;
+			}
+			break;
+
+		case '"':
+		{
+			// String literal: ends at the next unescaped quote. Without one on the same line the
+			// quote is treated as a regular character.
+			char* closing = it + 1;
+			while(closing != end && *closing != '"' && *closing != '\n')
+			{
+				if(*closing == '\\' && end - closing >= 2)
+					closing++;
+				closing++;
+			}
+			if(closing != end && *closing == '"')
+				it = closing;
+			break;
+		}
+		}
+		++it;
+	}
+}
+
+/// Snippet attributes, recognized with a single dispatch on their first character
+/** Each branch tries at most two keywords, instead of trying all attributes in turn. Tessellation
+	attributes share the "tess_" prefix and are told apart after it. */
+class ProgramFile::AttributeKeyword
+{
+public:
+	template<class Iterator, class Callback>
+	static bool Parse(Iterator& begin, Iterator end, Callback* callback)
+	{
+		if(begin == end)
+			return false;
+
+		switch(*begin)
+		{
+		case 'f': return Fragment::Parse(begin, end, callback);
+		case 'v': return Vertex::Parse(begin, end, callback);
+		case 'g': return Geometry::Parse(begin, end, callback);
+		case 'l': return LowQ::Parse(begin, end, callback);
+		case 'p': return Prio::Parse(begin, end, callback) || PrimitiveDescription::Parse(begin, end, callback);
+		case 'i': return InPrimitive::Parse(begin, end, callback) || Invocations::Parse(begin, end, callback);
+		case 'o': return OutPrimitive::Parse(begin, end, callback);
+		case 'm': return MaxVertices::Parse(begin, end, callback);
+		case 'a': return AutoEmission::Parse(begin, end, callback);
+		case 'c': return Cost::Parse(begin, end, callback);
+		case 's': return Specialization::Parse(begin, end, callback);
+		case 't': return Tessellation::Parse(begin, end, callback);
+		default: return false;
+		}
+	}
+
+private:
+	typedef Action<Keyword<'f','r','a','g','m','e','n','t'>, kFragmentStage> Fragment;
+	typedef Action<Keyword<'v','e','r','t','e','x'>, kVertexStage> Vertex;
+	typedef Action<Keyword<'g','e','o','m','e','t','r','y'>, kGeometryStage> Geometry;
+	typedef Action<Keyword<'l','o','w','_','q'>, kLowQuality> LowQ;
+	typedef Concatenation<Keyword<'p','r','i','o','='>, Action<Integer, kPriority> > Prio;
+	typedef Concatenation<Keyword<'i','n','_','p','r','i','m','='>, Action<Identifier, kInPrimitive> > InPrimitive;
+	typedef Concatenation<Keyword<'m','a','x','_','v','e','r','t','='>, Action<Integer, kMaxVertices> > MaxVertices;
+	typedef Concatenation<Keyword<'i','n','v','o','c','a','t','i','o','n','s','='>, Action<Integer, kInvocations> > Invocations;
+	typedef Concatenation<Keyword<'o','u','t','_','p','r','i','m','='>, Action<Identifier, kOutPrimitive> > OutPrimitive;
+	typedef Concatenation<Keyword<'s','p','e','c','='>, Action<Identifier, kSpecialization>, Char<':'>, Action<Word, kSpecializationValue> > Specialization;
+	typedef Concatenation<Keyword<'c','o','s','t','='>, Action<Integer, kCost> > Cost;
+	typedef Concatenation<
+			Keyword<'t','e','s','s','_'>,
+			Alternation<
+				Action<Keyword<'c','o','n','t','r','o','l'>, kTessControlStage>,
+				Action<Keyword<'e','v','a','l'>, kTessEvaluationStage>,
+				Concatenation<Keyword<'v','e','r','t','='>, Action<Integer, kTessVertices> >,
+				Concatenation<Keyword<'p','r','i','m','='>, Action<Identifier, kTessPrimitive> >,
+				Concatenation<Keyword<'s','p','a','c','i','n','g','='>, Action<Identifier, kTessSpacing> >,
+				Concatenation<Keyword<'o','r','d','e','r','='>, Action<Identifier, kTessOrdering> > > > Tessellation;
+	typedef Alternation<Keyword<'t','r','u','e'>, Keyword<'f','a','l','s','e'> > Boolean;
+	typedef Concatenation<Keyword<'a','u','t','o','_','e','m','i','t','='>, Action<Boolean, kAutoEmission> > AutoEmission;
+	typedef Concatenation<
+			Keyword<'p','r','i','m','_','d','s','c','r','='>,
+			Action<Integer, kGeometryPrimitiveDescription>,
+			Repetition<Concatenation<Char<','>, Action<Integer, kGeometryPrimitiveDescription> > > > PrimitiveDescription;
+};
+
 bool ProgramFile::Parse(char* begin, char* end)
 {
 	// Brainfuck...
-	typedef Concatenation<Alpha, Repetition<Alternation<Alpha, Digit, Char<'_'>> > > Identifier;
-	typedef Action<Concatenation<Char<'f'>, Char<'r'>, Char<'a'>, Char<'g'>, Char<'m'>, Char<'e'>, Char<'n'>, Char<'t'> >, kFragmentStage> Fragment;
-	typedef Action<Concatenation<Char<'v'>, Char<'e'>, Char<'r'>, Char<'t'>, Char<'e'>, Char<'x'> >, kVertexStage> Vertex;
-	typedef Action<Concatenation<Char<'g'>, Char<'e'>, Char<'o'>, Char<'m'>, Char<'e'>, Char<'t'>, Char<'r'>, Char<'y'> >, kGeometryStage> Geometry;
-	typedef Action<Concatenation<Char<'l'>, Char<'o'>, Char<'w'>, Char<'_'>, Char<'q'> >, kLowQuality> LowQ;
-	typedef Concatenation<Char<'p'>, Char<'r'>, Char<'i'>, Char<'o'>, Char<'='>, Action<Integer, kPriority> > Prio;
-	typedef Concatenation<Char<'i'>, Char<'n'>, Char<'_'>, Char<'p'>, Char<'r'>, Char<'i'>, Char<'m'>, Char<'='>,  Action<Identifier, kInPrimitive> > InPrimitive;
-	typedef Concatenation<Char<'m'>, Char<'a'>, Char<'x'>, Char<'_'>, Char<'v'>, Char<'e'>, Char<'r'>, Char<'t'>, Char<'='>, Action<Integer, kMaxVertices> > MaxVertives;
-	typedef Concatenation<Char<'o'>, Char<'u'>, Char<'t'>, Char<'_'>, Char<'p'>, Char<'r'>, Char<'i'>, Char<'m'>, Char<'='>, Action<Identifier, kOutPrimitive> > OutPrimitive;
-	typedef Concatenation<Char<'a'>, Char<'t'>, Char<'t'>, Char<'r'> > Attr;
-	typedef Concatenation<Char<'o'>, Char<'u'>, Char<'t'> > Out;
-	typedef Concatenation<Char<'i'>, Char<'n'>> In;
-	typedef Concatenation<Char<'i'>, Char<'n'>, Char<'o'>, Char<'u'>, Char<'t'> > Inout;
-	typedef Concatenation<Char<'t'>, Char<'r'>, Char<'u'>, Char<'e'> > True;
-	typedef Concatenation<Char<'f'>, Char<'a'>, Char<'l'>, Char<'s'>, Char<'e'> > False;
-	typedef Concatenation<Char<'a'>, Char<'u'>, Char<'t'>, Char<'o'>, Char<'_'>, Char<'e'>, Char<'m'>, Char<'i'>, Char<'t'>, Char<'='>, Action< Alternation<True, False>, kAutoEmission > > AutoEmission;	
-	typedef Concatenation<Char<'p'>, Char<'r'>, Char<'i'>, Char<'m'>, Char<'_'>, Char<'d'>, Char<'s'>, Char<'c'>, Char<'r'>, Char<'='> > Primitive;
-	typedef Concatenation< Primitive, Concatenation< Action<Integer, kGeometryPrimitiveDescription >, Repetition< Concatenation< Char<','>, Action< Integer, kGeometryPrimitiveDescription> > > > > PrimitiveDescription;
-	typedef Concatenation<Alternation<Fragment, Vertex, Geometry, LowQ, Prio, InPrimitive, OutPrimitive, MaxVertives, PrimitiveDescription, AutoEmission>, Whitespace> Attribute;
-	typedef Action<Concatenation<Char<'p'>, Char<'u'>, Char<'r'>, Char<'e'>>, kPure> Pure;
+	typedef Keyword<'a','t','t','r'> Attr;
+	typedef Keyword<'o','u','t'> Out;
+	typedef Keyword<'i','n'> In;
+	typedef Keyword<'i','n','o','u','t'> Inout;
+	typedef Concatenation<AttributeKeyword, Whitespace> Attribute;
+	typedef Action<Keyword<'p','u','r','e'>, kPure> Pure;
 
 	typedef Concatenation<
 			Option<Alternation<Concatenation<In, Whitespace>, Concatenation<Inout, Whitespace>,Action<Concatenation<Attr, Whitespace>, kAttribute >, Action<Concatenation<Out, Whitespace>, kOutput > > >,
@@ -116,7 +378,16 @@ bool ProgramFile::Parse(char* begin, char* end)
 		PureFunction;
 
 
-	typedef Concatenation<Repetition<Alternation<Function, PureFunction>>, Option<Whitespace>, Option<Char<0> > > File;
+	typedef Concatenation<
+				Option<Whitespace>,
+				Keyword<'i','m','p','o','r','t'>,
+				Whitespace,
+				Char<'"'>,
+				Action<QuotedText, kImport>,
+				Char<'"'> >
+		Import;
+
+	typedef Concatenation<Repetition<Alternation<Import, Function, PureFunction>>, Option<Whitespace>, Option<Char<0> > > File;
 	
 
 	bool success = File::Parse(begin, end, this);
@@ -155,6 +426,14 @@ void ProgramFile::ParserAction(int action, char* begin, char* end)
 		mCurrentFunction.stage = ProgramGenerator::Function::Stage::kFragmentStage;
 		break;
 
+	case kTessControlStage:
+		mCurrentFunction.stage = ProgramGenerator::Function::Stage::kTessControlStage;
+		break;
+
+	case kTessEvaluationStage:
+		mCurrentFunction.stage = ProgramGenerator::Function::Stage::kTessEvaluationStage;
+		break;
+
 	case kType:
 		mCurrentVariable.type = std::string(begin, end);
 		break;
@@ -174,7 +453,7 @@ void ProgramFile::ParserAction(int action, char* begin, char* end)
 	case kFunctionName:
 		mCurrentFunction.output = HashUtils::MakeHash(begin, end);
 		mCurrentVariable.name = std::string(begin, end);
-		mVariables.push_back(mCurrentVariable);
+		mVariables.push_back(std::move(mCurrentVariable));
 		mCurrentVariable = ProgramGenerator::VariableInfo(); // Restore defaults
 		mCurrentFunction.name = std::string(begin, end);
 		break;
@@ -193,7 +472,7 @@ void ProgramFile::ParserAction(int action, char* begin, char* end)
 		mCurrentFunction.inputs.push_back(hash);
 		mCurrentFunction.input_names.push_back(std::string(begin,end));
 		mCurrentVariable.name = std::string(begin, end);
-		mVariables.push_back(mCurrentVariable);
+		mVariables.push_back(std::move(mCurrentVariable));
 		mCurrentVariable = ProgramGenerator::VariableInfo(); // Restore defaults
 		break;
 	}
@@ -207,8 +486,7 @@ void ProgramFile::ParserAction(int action, char* begin, char* end)
 		break;
 
 	case kFunction:
-		mFunctions.push_back(mCurrentFunction);
-		mCurrentFunction = ProgramGenerator::Function(); // Restore defaults
+		FinishFunction();
 		break;
 
 	case kInPrimitive:
@@ -230,10 +508,32 @@ void ProgramFile::ParserAction(int action, char* begin, char* end)
 	}
 
 	case kMaxVertices:
+	{
+		tmp = *end;
+		*end = 0;
+		long maxVertices = strtol(begin, nullptr, 10);
+		*end = tmp;
+		if(maxVertices <= 0)
+			throw std::invalid_argument("A geometry shader needs to emit at least one vertex");
+		if(!mCurrentFunction.gsInfo)
+			mCurrentFunction.gsInfo = std::make_shared<ProgramGenerator::GSInfo>();
+		mCurrentFunction.gsInfo->mMaxVertices = maxVertices;
+		break;
+	}
+
+	case kInvocations:
+	{
+		tmp = *end;
+		*end = 0;
+		long invocations = strtol(begin, nullptr, 10);
+		*end = tmp;
+		if(invocations <= 0)
+			throw std::invalid_argument("A geometry shader needs at least one invocation");
 		if(!mCurrentFunction.gsInfo)
 			mCurrentFunction.gsInfo = std::make_shared<ProgramGenerator::GSInfo>();
-		mCurrentFunction.gsInfo->mMaxVertices = std::strtoul(begin, nullptr, 10);
+		mCurrentFunction.gsInfo->mInvocations = invocations;
 		break;
+	}
 
 	case kGeometryPrimitiveDescription:
 		if(!mCurrentFunction.gsInfo)
@@ -247,20 +547,180 @@ void ProgramFile::ParserAction(int action, char* begin, char* end)
 		mCurrentFunction.gsInfo->mEnableAutoEmission = (std::string("true") == std::string(begin, end));
 		break;
 
+	case kTessVertices:
+		if(!mCurrentFunction.tessInfo)
+			mCurrentFunction.tessInfo = std::make_shared<ProgramGenerator::TessInfo>();
+		mCurrentFunction.tessInfo->mPatchVertices = std::strtoul(begin, nullptr, 10);
+		break;
+
+	case kTessPrimitive:
+		if(!mCurrentFunction.tessInfo)
+			mCurrentFunction.tessInfo = std::make_shared<ProgramGenerator::TessInfo>();
+		mCurrentFunction.tessInfo->mPrimitive = std::string(begin, end);
+		break;
+
+	case kTessSpacing:
+		if(!mCurrentFunction.tessInfo)
+			mCurrentFunction.tessInfo = std::make_shared<ProgramGenerator::TessInfo>();
+		mCurrentFunction.tessInfo->mSpacing = std::string(begin, end);
+		break;
+
+	case kTessOrdering:
+		if(!mCurrentFunction.tessInfo)
+			mCurrentFunction.tessInfo = std::make_shared<ProgramGenerator::TessInfo>();
+		mCurrentFunction.tessInfo->mOrdering = std::string(begin, end);
+		break;
+
 	case kPureFunction:
 		// By design pure function should not depend on any inputs
 		if(mCurrentFunction.inputs.size() != 0 ||
 			mCurrentFunction.source.size() != 0)
 			throw std::runtime_error("Internal parser error");
 		mCurrentFunction.source.push_back(std::string(begin, end));
-		mFunctions.push_back(mCurrentFunction);
-		mCurrentFunction = ProgramGenerator::Function(); // Restore defaults
+		FinishFunction();
 		break;
 
 	case kPure:
 		mCurrentFunction.pureFunction = true;
 		break;
+
+	case kImport:
+		mImports.push_back(std::string(begin, end));
+		break;
+
+	case kSpecialization:
+		mCurrentFunction.specializations.push_back(ProgramGenerator::Specialization(HashUtils::MakeHash(begin, end), std::string()));
+		break;
+
+	case kSpecializationValue:
+		mCurrentFunction.specializations.back().second.assign(begin, end);
+		break;
+
+	case kCost:
+		tmp = *end;
+		*end = 0;
+		mCurrentFunction.cost = strtol(begin, nullptr, 10);
+		*end = tmp;
+		if(mCurrentFunction.cost < 0)
+			throw std::invalid_argument("Cost of a function cannot be negative");
+		break;
+	}
+}
+
+void ProgramFile::FinishFunction()
+{
+	const ProgramGenerator::Function& f = mCurrentFunction;
+	auto sameGSInfo = [](const std::shared_ptr<ProgramGenerator::GSInfo>& a, const std::shared_ptr<ProgramGenerator::GSInfo>& b)
+	{
+		return a == b || (a && b && *a == *b);
+	};
+	auto sameTessInfo = [](const std::shared_ptr<ProgramGenerator::TessInfo>& a, const std::shared_ptr<ProgramGenerator::TessInfo>& b)
+	{
+		return a == b || (a && b && *a == *b);
+	};
+	auto identical = [&](const ProgramGenerator::Function& other)
+	{
+		return other.output == f.output
+				&& other.source == f.source
+				&& other.inputs == f.inputs
+				&& other.stage == f.stage
+				&& other.priority == f.priority
+				&& other.cost == f.cost
+				&& other.highQuality == f.highQuality
+				&& other.pureFunction == f.pureFunction
+				&& other.specializations == f.specializations
+				&& other.outputArraySizeSource == f.outputArraySizeSource
+				&& sameGSInfo(other.gsInfo, f.gsInfo)
+				&& sameTessInfo(other.tessInfo, f.tessInfo);
+	};
+	if(std::find_if(mFunctions.begin(), mFunctions.end(), identical) == mFunctions.end())
+		mFunctions.push_back(std::move(mCurrentFunction));
+	mCurrentFunction = ProgramGenerator::Function(); // Restore defaults
+}
+
+ProgramFileCache& ProgramFileCache::GetInstance()
+{
+	static ProgramFileCache instance;
+	return instance;
+}
+
+std::shared_ptr<const ProgramFile> ProgramFileCache::Load(const std::string& path)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	if(!stream)
+		throw std::runtime_error("Cannot open snippet file \"" + path + "\"");
+	std::vector<char> contents((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+	// FNV-1a
+	uint64_t contentHash = 14695981039346656037ull;
+	for(char c: contents)
+		contentHash = (contentHash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+
+#ifdef _WIN32
+	char canonical[_MAX_PATH];
+	std::string key = _fullpath(canonical, path.c_str(), _MAX_PATH) ? canonical : path;
+#else
+	char canonical[PATH_MAX];
+	std::string key = realpath(path.c_str(), canonical) ? canonical : path;
+#endif
+
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	auto it = mFiles.find(key);
+	if(it != mFiles.end() && it->second.contentHash == contentHash)
+	{
+		// Imports may have changed even if this file did not
+		bool importsValid = true;
+		for(auto& imported: it->second.file->GetImportedFiles())
+		{
+			if(Load(imported->GetPath()) != imported)
+				importsValid = false;
+		}
+		if(importsValid)
+			return it->second.file;
+	}
+
+	if(std::find(mLoading.begin(), mLoading.end(), key) != mLoading.end())
+		throw std::runtime_error("Import cycle involving snippet file \"" + path + "\"");
+	mLoading.push_back(key);
+	struct LoadingGuard
+	{
+		std::vector<std::string>& loading;
+		~LoadingGuard() {loading.pop_back();}
+	} guard{mLoading};
+
+	std::shared_ptr<ProgramFile> file;
+	try
+	{
+		file = std::make_shared<ProgramFile>(contents.data(), contents.data() + contents.size(), path);
+	}
+	catch(std::runtime_error& e)
+	{
+		throw std::runtime_error(std::string(e.what()) + " in snippet file \"" + path + "\"");
 	}
+	file->mContentHash = contentHash;
+	for(auto& import: file->mImports)
+		file->mImportedFiles.push_back(Load(ResolveImport(path, import)));
+
+	mFiles[key] = Entry{contentHash, file};
+	return file;
+}
+
+std::string ProgramFileCache::ResolveImport(const std::string& importingFile, const std::string& import)
+{
+	bool absolute = !import.empty() && (import[0] == '/' || import[0] == '\\' || (import.size() > 1 && import[1] == ':'));
+	if(absolute)
+		return import;
+
+	size_t separator = importingFile.find_last_of("/\\");
+	if(separator == std::string::npos)
+		return import;
+	return importingFile.substr(0, separator + 1) + import;
+}
+
+void ProgramFileCache::Clear()
+{
+	std::lock_guard<std::recursive_mutex> lock(mMutex);
+	mFiles.clear();
 }
 
 }
@@ -29,6 +29,7 @@ SOFTWARE.
 #include "ProgramGenerator.h"
 #include <stdexcept>
 #include <list>
+#include <mutex>
 
 namespace molecular
 {
@@ -41,11 +42,16 @@ namespace programgenerator
 	character = 'a' | 'b' ... 'z' | 'A' | 'B' ... 'Z' ;
 	number = [ '-' ], digit, { digit } ;
 	identifier = character, { character | digit } ;
+	value = ?one or more characters other than whitespace? ;
 	parameter = [whitespace], identifier, whitespace, identifier, [whitespace] ;
-	attribute = 'fragment' | 'vertex' | 'geometry' | 'low_q' | 'prio=', number | 'in_prim=', identifier | 'out_prim=', identifier | 'max_vert=', number | 'prim_dscr=', (number, ',')+ | 'auto_emit=', [false, true] | 'pure'
-	body = '{', ?text with balanced parantheses?, '}' ;
+	attribute = 'fragment' | 'vertex' | 'geometry' | 'low_q' | 'prio=', number | 'in_prim=', identifier | 'out_prim=', identifier | 'max_vert=', number | 'invocations=', number | 'prim_dscr=', (number, ',')+ | 'auto_emit=', [false, true] | 'pure' | 'spec=', identifier, ':', value | 'tess_control' | 'tess_eval' | 'tess_vert=', number | 'tess_prim=', identifier | 'tess_spacing=', identifier | 'tess_order=', identifier | 'cost=', number
+	body = '{', ?text with balanced parantheses, not counting those in comments and string literals?, '}' ;
 	function = [whitespace], {attribute, whitespace}, identifier, whitespace, identifier, [whitespace], '(', [parameter, {',', parameter}], ')', [whitespace], body ;
+	import = [whitespace], 'import', whitespace, '"', ?path relative to the importing file?, '"' ;
+	file = {import | function} ;
 	@endcode
+	Identical definitions of a function within a file are stored once. Imported files are not
+	copied into the importing file, see GetImports() and ProgramFileCache.
 */
 class ProgramFile
 {
@@ -56,15 +62,42 @@ public:
 			throw std::runtime_error("Parse error");
 	}
 
+	/// Parse a file with a known path
+	/** The path is used to resolve imports. Imported files are loaded through ProgramFileCache. */
+	ProgramFile(char* begin, char* end, const std::string& path) :
+		ProgramFile(begin, end)
+	{
+		mPath = path;
+	}
+
 	typedef std::vector<ProgramGenerator::Function> FunctionContainer;
 	typedef std::vector<ProgramGenerator::VariableInfo> VariableContainer;
 
-	const FunctionContainer& GetFunctions() const {return mFunctions;}
-	const VariableContainer& GetVariables() const {return mVariables;}
+	const FunctionContainer& GetFunctions() const & {return mFunctions;}
+	const VariableContainer& GetVariables() const & {return mVariables;}
+	/// Move functions out of an expiring ProgramFile
+	FunctionContainer GetFunctions() && {return std::move(mFunctions);}
+	/// Move variables out of an expiring ProgramFile
+	VariableContainer GetVariables() && {return std::move(mVariables);}
+
+	/// Paths of imported files, as written in the file
+	const std::vector<std::string>& GetImports() const {return mImports;}
+
+	/// Imported files, if this file was loaded by ProgramFileCache
+	/** In the order of GetImports(). */
+	const std::vector<std::shared_ptr<const ProgramFile>>& GetImportedFiles() const {return mImportedFiles;}
+
+	/// Path of the file, empty if parsed from memory without a path
+	const std::string& GetPath() const {return mPath;}
+
+	/// Hash of the file contents, if loaded by ProgramFileCache, otherwise 0
+	uint64_t GetContentHash() const {return mContentHash;}
 
 	void ParserAction(int action, char* begin, char* end);
 
 private:
+	friend class ProgramFileCache;
+
 	enum
 	{
 		kPriority,
@@ -87,40 +120,33 @@ private:
 		kAutoEmission,
 		kPure,
 		kPureFunction,
+		kImport,
+		kSpecialization,
+		kTessControlStage,
+		kTessEvaluationStage,
+		kTessVertices,
+		kTessPrimitive,
+		kTessSpacing,
+		kTessOrdering,
+		kCost,
+		kInvocations,
+		kSpecializationValue,
 	};
 
+	/// Function body up to (excluding) the closing brace
+	/** Braces inside comments and string literals are not counted. */
 	class Body
 	{
 	public:
-		template<class Iterator>
-		static bool Parse(Iterator& begin, Iterator end, void*)
-		{
-			if(begin == end)
-				return false;
-
-			Iterator oldBegin = begin;
-
-			int parensCount = 1;
-			while(begin != end)
-			{
-				if(*begin == '{')
-					parensCount++;
-				else if(*begin == '}')
-					parensCount--;
-
-				// Don't increment here
-
-				if(parensCount == 0)
-					return true;
-
-				// Increment here to keep surrounding closing bracket in buffer:
-				begin++;
-			}
-			begin = oldBegin;
-			return false;
-		}
+		static bool Parse(char*& begin, char* end, void*);
 	};
 
+	/// Snippet attribute keyword, including its value
+	class AttributeKeyword;
+
+	/// Adds mCurrentFunction to mFunctions unless an identical definition exists
+	void FinishFunction();
+
 	bool Parse(char* begin, char* end);
 
 	ProgramGenerator::Function mCurrentFunction;
@@ -128,6 +154,44 @@ private:
 
 	FunctionContainer mFunctions;
 	VariableContainer mVariables;
+
+	std::vector<std::string> mImports;
+	std::vector<std::shared_ptr<const ProgramFile>> mImportedFiles;
+	std::string mPath;
+	uint64_t mContentHash = 0;
+};
+
+/// Process wide cache of parsed snippet files
+/** A file is parsed once, no matter how many files import it. Entries are keyed on the
+	canonical path and validated against a hash of the file contents, so changed files are
+	parsed again. Thread safe. */
+class ProgramFileCache
+{
+public:
+	static ProgramFileCache& GetInstance();
+
+	/// Load and parse a file and, recursively, the files it imports
+	/** @throws std::runtime_error if a file cannot be read or parsed, or if imports form a cycle. */
+	std::shared_ptr<const ProgramFile> Load(const std::string& path);
+
+	/// Resolve the path of an import relative to the importing file
+	static std::string ResolveImport(const std::string& importingFile, const std::string& import);
+
+	/// Drop all cached files
+	void Clear();
+
+private:
+	struct Entry
+	{
+		uint64_t contentHash;
+		std::shared_ptr<const ProgramFile> file;
+	};
+
+	/// Recursive, since loading a file loads its imports
+	std::recursive_mutex mMutex;
+	std::unordered_map<std::string, Entry> mFiles;
+	/// Files currently being loaded, for cycle detection
+	std::vector<std::string> mLoading;
 };
 
 }
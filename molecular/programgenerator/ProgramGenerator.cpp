@@ -24,16 +24,22 @@ SOFTWARE.
 */
 
 #include "ProgramGenerator.h"
+#include "ProgramFile.h"
+#include "SnippetLibrary.h"
+#include "ProgramCache.h"
+#include "ProgramEncoding.h"
+#include "SearchPool.h"
 #include <sstream>
+#include <cctype>
 #include <algorithm>
 #include <stdexcept>
 #include <unordered_set>
 #include <cassert>
-
-#ifndef LOG
-#include <iostream>
-#define LOG(x) std::cerr
-#endif
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
 
 namespace molecular
 {
@@ -41,6 +47,12 @@ namespace programgenerator
 {
 using namespace util;
 
+/// Mix a value into a running hash, boost::hash_combine style
+static inline size_t HashCombine(size_t seed, size_t value)
+{
+	return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
 //static std::string printFunctions(const std::vector<ProgramGenerator::Function*>& functions)
 //{
 //	std::stringstream functionsTrace;
@@ -72,222 +84,827 @@ using namespace util;
 //}
 
 std::string EmitGlslDeclaration(
-		Hash variable,
-		const ProgramGenerator::VariableInfo& info,
+		const ProgramGenerator::SnippetVariable& info,
 		const std::unordered_map<ProgramGenerator::Variable, int>& arraySizes)
 {
 	std::ostringstream oss;
-	oss << info.type << " " << info.name;
+	oss << *info.type << " " << *info.name;
 	if(info.array)
-		oss << "[" << arraySizes.at(variable) << "]";
+		oss << "[" << arraySizes.at(info.hash) << "]";
 	return oss.str();
 }
 
-/// Input to EmitGlslProgram(), and maybe other emitters in the future
-struct ProgramEmitterInput
+typedef ProgramGenerator::Function::Stage Stage;
+
+/// Number of shader stages
+static const size_t kStageCount = 5;
+
+/// Shader stages in the order of the pipeline
+static const Stage kPipeline[kStageCount] = {
+	Stage::kVertexStage,
+	Stage::kTessControlStage,
+	Stage::kTessEvaluationStage,
+	Stage::kGeometryStage,
+	Stage::kFragmentStage
+};
+
+/// Position of a stage in kPipeline
+static size_t PipelineIndex(Stage stage)
 {
-	/// Pure functions source code that is used in vertex shader
-	std::string vertexFunctionsCode;
-	/// Pure functions source code that is used in fragment shader
-	std::string fragmentFunctionsCode;
-	/// Pure functions source code that is used in geometry shader
-	std::string geometryFunctionsCode;
-	/// Body of main() of the vertex shader without local variable declarations
-	/** Consists of concatenated bodies of functions from the snippet files. */
-	std::string vertexCode;
-
-	/// Body of main() of the fragment shader without local variable declarations
-	/** Consists of concatenated bodies of functions from the snippet files. */
-	std::string fragmentCode;
-	/// Body of main() of geometry shader
-	std::vector<std::string> geometryCode;
-	/// Inputs to vertex shader, both attributes and uniforms
-	/** If a variable is an attribute or an uniform is decided based on information in
-		ProgramGenerator::VariableInfo */
-	std::unordered_set<ProgramGenerator::Variable> vertexInputs;
+	switch(stage)
+	{
+	case Stage::kVertexStage: return 0;
+	case Stage::kTessControlStage: return 1;
+	case Stage::kTessEvaluationStage: return 2;
+	case Stage::kGeometryStage: return 3;
+	case Stage::kFragmentStage: return 4;
+	}
+	return 0;
+}
+
+static const size_t kVertexIndex = 0;
+static const size_t kTessControlIndex = 1;
+static const size_t kTessEvaluationIndex = 2;
+static const size_t kGeometryIndex = 3;
+static const size_t kFragmentIndex = 4;
 
-	/// Local variables of the vertex shader
-	/** Can also become "out" variables if the same variable is used in the fragment shader. */
-	std::unordered_set<ProgramGenerator::Variable> vertexLocals;
+/// Checks if a function in stage consumer cannot use a variable computed in stage producer
+/** Variables are only passed forward in the pipeline, and only to the next enabled stage. */
+static bool InvalidStageDependence(Stage consumer, Stage producer, bool geometry, bool tessellation)
+{
+	size_t consumerIndex = PipelineIndex(consumer);
+	size_t producerIndex = PipelineIndex(producer);
+	if(producerIndex > consumerIndex)
+		return true;
+
+	for(size_t i = producerIndex + 1; i < consumerIndex; i++)
+	{
+		if(i == kGeometryIndex && geometry)
+			return true;
+		if((i == kTessControlIndex || i == kTessEvaluationIndex) && tessellation)
+			return true;
+	}
+	return false;
+}
 
-	/// Uniforms used in fragment shader
-	std::unordered_set<ProgramGenerator::Variable> fragmentUniforms;
+/// Input to EmitGlslProgram(), and maybe other emitters in the future
+struct ProgramEmitterInput
+{
+	/// Everything specific to one shader stage
+	struct StageInput
+	{
+		/// Pure functions source code that is used in this stage
+		std::string functionsCode;
+
+		/// Body of main() without local variable declarations
+		/** Consists of concatenated bodies of functions from the snippet files. Not used by the
+			geometry stage, see geometryCode. */
+		std::string code;
+
+		/// Program inputs used in this stage
+		/** Attributes if the variable is marked as one in ProgramGenerator::VariableInfo and this
+			is the vertex stage, otherwise uniforms. */
+		std::unordered_set<uint32_t> inputs;
+
+		/// Local variables of the stage
+		/** A local variable is computed in the first stage using it. If it is used in later stages,
+			it is declared as "out" there and as "in" in the next enabled stage. If it is requested
+			as an output of the program, it is declared as "out" in the fragment shader. */
+		std::unordered_set<uint32_t> locals;
+	};
 
-	/// Local variables in fragment shader
-	/** Can also become "in" or "out" variables: If they were used as local variables in the vertex
-		shader, they are declared as "out" in the vertex shader and as "in" in the fragment shader.
-		If they are requested as an output of the program, they are declared as "out" in the
-		fragment shader. */
-	std::unordered_set<ProgramGenerator::Variable> fragmentLocals;
+	/// Stages, indexed by PipelineIndex()
+	StageInput stages[kStageCount];
 
 	/// Attributes used in fragment shader
 	/** Attributes generally arrive in the vertex shader. If they are required in the fragment
 		shader however, they need to be passed into it explicitly. */
-	std::unordered_set<ProgramGenerator::Variable> fragmentAttributes;
-	/// Geometry shader locals
-	std::unordered_set<ProgramGenerator::Variable> geometryLocals;
-	/// Geometry shader uniforms
-	std::unordered_set<ProgramGenerator::Variable> geometryUniforms;
+	std::unordered_set<uint32_t> fragmentAttributes;
+	/// Body of main() of geometry shader
+	std::vector<std::string> geometryCode;
 	/// Geometry shader info data
 	/** E.g. input primitive, output primitive, etc.
 	*/
 	ProgramGenerator::GSInfo geometryShaderInfo;
+	/// Tessellation info data, shared by both tessellation stages
+	ProgramGenerator::TessInfo tessellationInfo;
+	/// Values of inputs that are declared "const" instead of "uniform", may be nullptr
+	const ProgramGenerator::Constants* constants = nullptr;
+	/// Variables written to transform feedback buffers, in buffer order
+	std::vector<ProgramGenerator::Variable> captured;
+	/// Inputs that were captured before, and are read as attributes
+	std::unordered_set<ProgramGenerator::Variable> capturedAttributes;
+
+	/// Checks if an input is a vertex attribute
+	bool IsAttribute(const ProgramGenerator::SnippetVariable& info) const
+	{
+		return info.usage == ProgramGenerator::VariableInfo::Usage::kAttribute || capturedAttributes.count(info.hash);
+	}
+
+	bool IsEnabled(size_t stage) const
+	{
+		if(stage == kGeometryIndex)
+			return geometryShaderInfo.enabled;
+		else if(stage == kTessControlIndex || stage == kTessEvaluationIndex)
+			return tessellationInfo.enabled;
+		return true;
+	}
 };
 
-/// Convert program generator output to actual GLSL text
-ProgramGenerator::ProgramText EmitGlslProgram(
+/// Declaration of a program input that is not an attribute
+std::string EmitGlslUniform(
+		const ProgramEmitterInput& input,
+		const ProgramGenerator::SnippetVariable& info,
+		const std::unordered_map<ProgramGenerator::Variable, int>& arraySizes)
+{
+	if(input.constants)
+	{
+		auto constant = input.constants->find(info.hash);
+		if(constant != input.constants->end())
+			return "const " + EmitGlslDeclaration(info, arraySizes) + " = " + constant->second + ";\n";
+	}
+	return "uniform " + EmitGlslDeclaration(info, arraySizes) + ";\n";
+}
+
+/// Text of a program except for the code of the snippets
+/** Each shader is assembled from its Stage as: header, pure functions, "void main()\n{\n",
+	locals, code, epilogue, "}\n". */
+struct ProgramDeclarations
+{
+	struct Stage
+	{
+		/// Global declarations
+		std::string header;
+		/// Local variable declarations at the beginning of main()
+		std::string locals;
+		/// Code at the end of main()
+		std::string epilogue;
+		/// Names of the variables declared in locals that are not visible outside of the shader
+		std::vector<std::string> localNames;
+	};
+
+	/// Stages, indexed by PipelineIndex()
+	Stage stages[kStageCount];
+
+	/// Names of captured variables for glTransformFeedbackVaryings(), in buffer order
+	std::vector<std::string> capturedVaryings;
+};
+
+/// Name of the interface block with the outputs of each stage
+static const char* const kInterfaceBlocks[kStageCount] = {"VS_OUT", "TCS_OUT", "TES_OUT", "GS_OUT", ""};
+/// Instance names of output interface blocks, stages writing per-vertex arrays need them
+static const char* const kOutputInstances[kStageCount] = {"", " tcs_out[]", "", " gs_out", ""};
+/// Instance names of input interface blocks, all stages but the fragment stage receive arrays
+static const char* const kInputInstances[kStageCount] = {"", " tcs_in[]", " tes_in[]", " gs_in[]", ""};
+
+/// Stage computing each local variable, which is the first stage using it
+static std::unordered_map<uint32_t, size_t> FindProducers(const ProgramEmitterInput& input)
+{
+	std::unordered_map<uint32_t, size_t> producers;
+	for(size_t i = 0; i < kStageCount; i++)
+	{
+		for(auto it: input.stages[i].locals)
+			producers.insert(std::make_pair(it, i));
+	}
+	return producers;
+}
+
+/// Checks if a stage after the given one uses a local variable
+static bool UsedLater(const ProgramEmitterInput& input, size_t stage, uint32_t variable)
+{
+	for(size_t i = stage + 1; i < kStageCount; i++)
+	{
+		if(input.stages[i].locals.count(variable))
+			return true;
+	}
+	return false;
+}
+
+/// Indices of variables sorted by name, so that declarations do not depend on hashing
+static std::vector<uint32_t> SortedByName(const std::unordered_set<uint32_t>& indices, const SnippetLibrary& variables)
+{
+	std::vector<uint32_t> sorted(indices.begin(), indices.end());
+	std::sort(sorted.begin(), sorted.end(), [&variables](uint32_t a, uint32_t b){
+		return *variables.GetVariable(a).name < *variables.GetVariable(b).name;
+	});
+	return sorted;
+}
+
+/// Checks if variables of a type are opaque, e.g. samplers and images
+static bool IsOpaqueType(const std::string& type)
+{
+	return type.find("sampler") != std::string::npos || type.find("image") != std::string::npos || type == "atomic_uint";
+}
+
+/// Number of locations a vertex input, varying or fragment output of a type occupies
+static int LocationCount(const std::string& type, int arraySize)
+{
+	int count = 1;
+	if(type.compare(0, 3, "mat") == 0 || type.compare(0, 4, "dmat") == 0)
+		count = type[type.find("mat") + 3] - '0'; // One per column
+	if(type[0] == 'd' && type.back() >= '3' && type.back() <= '4')
+		count *= 2; // dvec3, dvec4 and double matrices with such columns
+	return count * std::max(arraySize, 1);
+}
+
+/// Size in bytes of a variable of a type in a transform feedback buffer
+static int CaptureSize(const std::string& type, int arraySize)
+{
+	const bool isDouble = type[0] == 'd';
+	const bool isInteger = type[0] == 'i' || type[0] == 'u';
+	int components = 0;
+	if(type == "float" || type == "double" || type == "int" || type == "uint")
+		components = 1;
+	else
+	{
+		// Vectors and matrices, without the prefix of ivec, uvec, dvec and dmat:
+		const std::string shape = (isInteger || isDouble) ? type.substr(1) : type;
+		const int size = shape.size() > 3 ? shape[3] - '0' : 0;
+		if(size < 2 || size > 4)
+			components = 0;
+		else if(shape.size() == 4 && shape.compare(0, 3, "vec") == 0)
+			components = size;
+		else if(isInteger || shape.compare(0, 3, "mat") != 0)
+			components = 0;
+		else if(shape.size() == 4)
+			components = size * size;
+		else if(shape.size() == 6 && shape[4] == 'x' && shape[5] >= '2' && shape[5] <= '4')
+			components = size * (shape[5] - '0');
+	}
+	if(!components)
+		throw std::invalid_argument("Variables of type \"" + type + "\" cannot be captured");
+	return components * (isDouble ? 8 : 4) * std::max(arraySize, 1);
+}
+
+/// Last enabled stage before rasterization, which writes captured variables
+static size_t CaptureStage(const ProgramEmitterInput& input)
+{
+	if(input.IsEnabled(kGeometryIndex))
+		return kGeometryIndex;
+	if(input.IsEnabled(kTessEvaluationIndex))
+		return kTessEvaluationIndex;
+	return kVertexIndex;
+}
+
+/// Built-in block redeclared by stages writing or reading gl_Position, see EmitOptions::separable
+static const char* const kPerVertexBlock = "gl_PerVertex {\n\tvec4 gl_Position;\n\tfloat gl_PointSize;\n\tfloat gl_ClipDistance[];\n}";
+/// Instance names of the redeclared output block of each stage
+static const char* const kPerVertexOutputs[kStageCount] = {"", " gl_out[]", "", "", nullptr};
+/// Instance names of the redeclared input block of each stage
+static const char* const kPerVertexInputs[kStageCount] = {nullptr, " gl_in[gl_MaxPatchVertices]", " gl_in[gl_MaxPatchVertices]", " gl_in[]", nullptr};
+
+/// Generate the declarations of a program
+/** Declarations are sorted by name. Locations are assigned in this order, separately for
+	uniforms, attributes, fragment outputs and each interface between two stages. With
+	EmitOptions::separable, uniforms are numbered separately for each stage.
+	@param reflection Receives the interface of the program, may be nullptr. */
+ProgramDeclarations EmitGlslDeclarations(
 		const ProgramEmitterInput& input,
 		const std::set<ProgramGenerator::Variable>& outputs,
 		const std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
-		const std::unordered_map<ProgramGenerator::Variable, ProgramGenerator::VariableInfo>& variableInfos)
+		const SnippetLibrary& variables,
+		const ProgramGenerator::EmitOptions& options,
+		ProgramGenerator::Reflection* reflection = nullptr)
 {
+	typedef ProgramGenerator::ReflectedVariable ReflectedVariable;
+	const std::unordered_map<uint32_t, size_t> producers = FindProducers(input);
+	const bool explicitLocations = options.explicitLocations || options.separable;
+	ProgramGenerator::Reflection reflected;
 
-	std::ostringstream vertexInputsString, vertexGlobalsString, vertexLocalsString;
-	std::vector<std::string> vertexOutputs;
-	for(auto it: input.vertexInputs)
+	auto arraySize = [&arraySizes](const ProgramGenerator::SnippetVariable& info)
 	{
-		// Inputs can either be uniforms or attributes:
-		auto info = variableInfos.at(it);
-		if(info.usage != ProgramGenerator::VariableInfo::Usage::kAttribute)
-			vertexGlobalsString << "uniform " << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
-		else
-			vertexInputsString << "in " << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
-	}
+		return info.array ? arraySizes.at(info.hash) : 0;
+	};
+	auto layout = [explicitLocations](int location)
+	{
+		return explicitLocations ? "layout(location = " + std::to_string(location) + ") " : std::string();
+	};
+	auto reflect = [&](const ProgramGenerator::SnippetVariable& info, size_t stage, int location)
+	{
+		ReflectedVariable variable;
+		variable.variable = info.hash;
+		variable.name = *info.name;
+		variable.type = *info.type;
+		variable.arraySize = arraySize(info);
+		variable.location = explicitLocations ? location : -1;
+		variable.stage = kPipeline[stage];
+		return variable;
+	};
+	auto isAttribute = [&](size_t stage, uint32_t index)
+	{
+		return stage == kVertexIndex && input.IsAttribute(variables.GetVariable(index));
+	};
 
-	for(auto it: input.vertexLocals)
+	// Uniform locations are shared by all stages, unless each stage is a program of its own:
+	std::unordered_set<uint32_t> uniforms, stageUniforms[kStageCount];
+	for(size_t i = 0; i < kStageCount; i++)
 	{
-		auto info = variableInfos.at(it);
-		if(strncmp(info.name.data(), "gl_", 3)) // Do not declare predefined variables
+		for(auto it: input.stages[i].inputs)
 		{
-			/* If this is also used as a local variable in the fragment shader, declare as "out".
-				It is later declared as "in" in the fragment shader. */
-			if(input.fragmentLocals.count(it) || input.geometryLocals.count(it))
-				vertexOutputs.push_back(EmitGlslDeclaration(it, info, arraySizes));
-			else
-				vertexLocalsString << "\t" << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
+			if(isAttribute(i, it) || (input.constants && input.constants->count(variables.GetVariable(it).hash)))
+				continue;
+			uniforms.insert(it);
+			stageUniforms[i].insert(it);
 		}
 	}
-	
-	std::ostringstream geometryGlobalsString, geometryLocalsString,
-						geometryLayout;
-	std::vector<std::string> geometryOutputs;
-	for(auto it : input.geometryLocals)
+	std::unordered_map<uint32_t, int> uniformLocations[kStageCount];
+	int nextUniformLocations[kStageCount] = {};
+	for(auto it: SortedByName(uniforms, variables))
 	{
-		auto info = variableInfos.at(it);
-		if(strncmp(info.name.data(), "gl_", 3))
+		const auto& info = variables.GetVariable(it);
+		std::vector<ReflectedVariable>& list = IsOpaqueType(*info.type) ? reflected.samplers : reflected.uniforms;
+		const int size = std::max(arraySize(info), 1);
+		if(options.separable)
+		{
+			for(size_t i = 0; i < kStageCount; i++)
+			{
+				if(!stageUniforms[i].count(it))
+					continue;
+				uniformLocations[i][it] = nextUniformLocations[i];
+				list.push_back(reflect(info, i, nextUniformLocations[i]));
+				nextUniformLocations[i] += size;
+			}
+		}
+		else
 		{
-			if(input.fragmentLocals.count(it))
-				geometryOutputs.push_back(EmitGlslDeclaration(it, info, arraySizes));
-			else if(!input.vertexLocals.count(it))
-				geometryLocalsString << "\t" << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
+			size_t firstUse = kStageCount;
+			for(size_t i = 0; i < kStageCount; i++)
+			{
+				if(!stageUniforms[i].count(it))
+					continue;
+				uniformLocations[i][it] = nextUniformLocations[0];
+				firstUse = std::min(firstUse, i);
+			}
+			list.push_back(reflect(info, firstUse, nextUniformLocations[0]));
+			nextUniformLocations[0] += size;
 		}
 	}
-	
-	for(auto it : input.geometryUniforms)
+
+	// Captured variables, with their offsets in the buffer if declared with layouts:
+	ProgramDeclarations declarations;
+	const size_t captureStage = CaptureStage(input);
+	const bool captureBlock = captureStage == kGeometryIndex; // Written through gs_out
+	std::unordered_map<ProgramGenerator::Variable, int> captureOffsets;
+	int captureOffset = 0;
+	for(auto variable: input.captured)
+	{
+		const ProgramGenerator::SnippetVariable* info = variables.FindVariable(variable);
+		if(!info)
+			throw std::out_of_range("Captured variable used without declaration");
+		if(options.captureLayouts && !strncmp(info->name->data(), "gl_", 3))
+			throw std::invalid_argument("Built-in variable \"" + *info->name + "\" cannot be captured with layouts");
+		const int size = options.captureLayouts ? CaptureSize(*info->type, arraySize(*info)) : 0;
+		if(info->type->front() == 'd')
+			captureOffset = (captureOffset + 7) & ~7; // Doubles are aligned to 8 bytes
+		captureOffsets[variable] = captureOffset;
+		captureOffset += size;
+		declarations.capturedVaryings.push_back((captureBlock ? std::string(kInterfaceBlocks[captureStage]) + "." : std::string()) + *info->name);
+	}
+	std::ostringstream captureDeclarations;
+	std::unordered_set<ProgramGenerator::Variable> captureDeclared;
+
+	std::ostringstream globals[kStageCount], locals[kStageCount];
+	std::vector<std::string> localNames[kStageCount];
+	std::ostringstream vertexInputsString, fragmentOutputsString;
+	std::vector<std::string> interfaces[kStageCount]; // Variables passed to the next stage
+	std::vector<uint32_t> interfaceVariables[kStageCount];
+	int nextAttributeLocation = 0, nextOutputLocation = 0;
+	for(size_t i = 0; i < kStageCount; i++)
 	{
-		auto info = variableInfos.at(it);
-		geometryGlobalsString << "uniform " << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
+		const ProgramEmitterInput::StageInput& stage = input.stages[i];
+		for(auto it: SortedByName(stage.inputs, variables))
+		{
+			// Inputs can either be uniforms or attributes:
+			const auto& info = variables.GetVariable(it);
+			if(isAttribute(i, it))
+			{
+				vertexInputsString << layout(nextAttributeLocation) << "in " << EmitGlslDeclaration(info, arraySizes) << ";\n";
+				reflected.attributes.push_back(reflect(info, i, nextAttributeLocation));
+				nextAttributeLocation += LocationCount(*info.type, arraySize(info));
+			}
+			else
+			{
+				auto location = uniformLocations[i].find(it);
+				if(location != uniformLocations[i].end())
+					globals[i] << layout(location->second);
+				globals[i] << EmitGlslUniform(input, info, arraySizes);
+			}
+		}
+
+		for(auto it: SortedByName(stage.locals, variables))
+		{
+			const auto& info = variables.GetVariable(it);
+			// If this is requested as an output of the program, declare as "out":
+			if(i == kFragmentIndex && outputs.count(info.hash))
+			{
+				fragmentOutputsString << layout(nextOutputLocation) << "out " << EmitGlslDeclaration(info, arraySizes) << ";\n";
+				reflected.outputs.push_back(reflect(info, i, nextOutputLocation));
+				nextOutputLocation += LocationCount(*info.type, arraySize(info));
+				continue;
+			}
+
+			// Captured variables are outputs of the stage writing them:
+			auto capture = captureOffsets.find(info.hash);
+			if(i == captureStage && capture != captureOffsets.end() && producers.at(it) == i)
+			{
+				captureDeclared.insert(info.hash);
+				if(!strncmp(info.name->data(), "gl_", 3))
+					continue;
+				if(options.captureLayouts)
+					captureDeclarations << (captureBlock ? "\tlayout(" : "layout(xfb_buffer = 0, ") << "xfb_offset = " << capture->second << ") ";
+				else if(captureBlock)
+					captureDeclarations << "\t";
+				captureDeclarations << (captureBlock ? "" : "out ") << EmitGlslDeclaration(info, arraySizes) << ";\n";
+				continue;
+			}
+
+			// Do not declare predefined variables or variables received from an earlier stage
+			if(!strncmp(info.name->data(), "gl_", 3) || producers.at(it) != i)
+				continue;
+
+			if(UsedLater(input, i, it))
+			{
+				interfaces[i].push_back(EmitGlslDeclaration(info, arraySizes));
+				interfaceVariables[i].push_back(it);
+			}
+			else
+			{
+				locals[i] << "\t" << EmitGlslDeclaration(info, arraySizes) << ";\n";
+				if(!outputs.count(info.hash))
+					localNames[i].push_back(*info.name);
+			}
+		}
 	}
-	
-	//set up geometry shader layout
-	geometryLayout << "layout(" << input.geometryShaderInfo.mInPrimitive << ") in;\n";
-	geometryLayout << "layout(" << input.geometryShaderInfo.mOutPrimitive <<
-		", max_vertices = " << input.geometryShaderInfo.mMaxVertices << ") out;\n";
 
-	std::ostringstream fragmentInputsString, fragmentOutputsString,
-						fragmentGlobalsString, fragmentLocalsString;
-	
-	for(auto it: input.fragmentUniforms)
+	for(auto variable: input.captured)
+	{
+		if(!captureDeclared.count(variable))
+			throw std::invalid_argument("Captured variable \"" + *variables.FindVariable(variable)->name + "\" is not computed by the last stage before rasterization");
+	}
+	if(captureBlock && !input.captured.empty())
 	{
-		auto info = variableInfos.at(it);
-		fragmentGlobalsString << "uniform " << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
+		globals[captureStage] << (options.captureLayouts ? "layout(xfb_buffer = 0) " : "") << "out " << kInterfaceBlocks[captureStage] << " {\n"
+				<< captureDeclarations.str() << "}" << kOutputInstances[captureStage] << ";\n";
 	}
+	else
+		globals[captureStage] << captureDeclarations.str();
 
-	for(auto it: input.fragmentLocals)
+	// Interface between each enabled stage and the next one:
+	std::string inputInterfaces[kStageCount], outputInterfaces[kStageCount];
+	int interfaceLocations[kStageCount] = {}; // Locations used by the interface of each stage
+	for(size_t i = 0; i < kStageCount; i++)
 	{
-		auto info = variableInfos.at(it);
-		// If this is requested as an output of the program, declare as "out":
-		if(outputs.count(it))
-			fragmentOutputsString << "out " << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
+		if(!input.IsEnabled(i) || interfaces[i].empty())
+			continue;
+		size_t next = i + 1;
+		while(!input.IsEnabled(next))
+			next++;
+
+		int location = 0;
+		std::vector<int> locations;
+		for(auto it: interfaceVariables[i])
+		{
+			const auto& info = variables.GetVariable(it);
+			locations.push_back(location);
+			reflected.varyings.push_back(reflect(info, i, location));
+			location += LocationCount(*info.type, arraySize(info));
+		}
+		interfaceLocations[i] = interfaceLocations[next] = location;
+
+		std::ostringstream out, in;
+		if(i == kVertexIndex && next == kFragmentIndex)
+		{
+			// Plain variables without blocks
+			for(size_t j = 0; j < interfaces[i].size(); j++)
+			{
+				out << layout(locations[j]) << "out " << interfaces[i][j] << ";\n";
+				in << layout(locations[j]) << "in " << interfaces[i][j] << ";\n";
+			}
+		}
 		else
 		{
-			if(!(input.vertexLocals.count(it) || input.geometryLocals.count(it)))
-				fragmentLocalsString << "\t" << EmitGlslDeclaration(it, info, arraySizes) << ";\n";
+			// Members of a block get consecutive locations from the location of the block
+			out << layout(0) << "out " << kInterfaceBlocks[i] << " {\n";
+			in << layout(0) << "in " << kInterfaceBlocks[i] << " {\n";
+			for(const auto& declaration: interfaces[i])
+			{
+				out << "\t" << declaration << ";\n";
+				in << "\t" << declaration << ";\n";
+			}
+			out << "}" << kOutputInstances[i] << ";\n";
+			in << "}" << kInputInstances[next] << ";\n";
+		}
+		outputInterfaces[i] = out.str();
+		inputInterfaces[next] = in.str();
+	}
+
+	// Separable stages redeclare the built-in blocks they use:
+	if(options.separable)
+	{
+		for(size_t i = 0; i < kStageCount; i++)
+		{
+			if(!input.IsEnabled(i))
+				continue;
+			if(kPerVertexInputs[i])
+				inputInterfaces[i] += "in " + std::string(kPerVertexBlock) + kPerVertexInputs[i] + ";\n";
+			if(kPerVertexOutputs[i])
+				outputInterfaces[i] += "out " + std::string(kPerVertexBlock) + kPerVertexOutputs[i] + ";\n";
 		}
 	}
-	
+
 	// Passing vertex shader attributes to fragment shader:
 	//TODO: add geometry shader support (problematic since GS source itself should be modified)
 	//WARNING: this will not work if geometry shader will be enabled
 	std::ostringstream vertexToFragmentPassingCode;
-	for(auto it: input.fragmentAttributes)
+	int vertexLocation = interfaceLocations[kVertexIndex], fragmentLocation = interfaceLocations[kFragmentIndex];
+	for(auto it: SortedByName(input.fragmentAttributes, variables))
 	{
-		auto info = variableInfos.at(it);
+		const auto& info = variables.GetVariable(it);
 		// Declare an "in" variable (attribute name prefixed with "vf_") in fragment shader:
-		fragmentGlobalsString << "in " << info.type << " vf_" << info.name << ";\n";
+		globals[kFragmentIndex] << layout(fragmentLocation) << "in " << *info.type << " vf_" << *info.name << ";\n";
 		// Declare same variable as "out" in vertex shader:
-		vertexGlobalsString << "out " << info.type << " vf_" << info.name << ";\n";
-//		fragmentLocalsString << "\t" << info.Declaration(arraySizes[*it]);
+		globals[kVertexIndex] << layout(vertexLocation) << "out " << *info.type << " vf_" << *info.name << ";\n";
+		ReflectedVariable varying = reflect(info, kVertexIndex, vertexLocation);
+		varying.name = "vf_" + varying.name;
+		reflected.varyings.push_back(std::move(varying));
+		vertexLocation += LocationCount(*info.type, 0);
+		fragmentLocation += LocationCount(*info.type, 0);
 		// Assign attribute value to new "vf_" variable in vertex shader:
-		vertexToFragmentPassingCode << "\tvf_" << info.name << " = " << info.name << ";\n";
+		vertexToFragmentPassingCode << "\tvf_" << *info.name << " = " << *info.name << ";\n";
 		/* Declare variable with the same name as the attribute in fragment shader. Assign value
 			of "vf_" variable to it: */
-		fragmentLocalsString << "\t" << info.name << " = vf_" << info.name << ";\n";
+		locals[kFragmentIndex] << "\t" << *info.name << " = vf_" << *info.name << ";\n";
 	}
 
-	// Assemble final shader text:
-	std::ostringstream vertexShader, fragmentShader, geometryShader;
-
 	//generate vertex shader
-	vertexShader << vertexGlobalsString.str() << std::endl;
-	vertexShader << vertexInputsString.str() << std::endl;
-	std::string outVarPrefix = input.geometryShaderInfo.enabled ? "\t" : "out ";
-	std::string inVarPrefix = input.geometryShaderInfo.enabled ? "\t" : "in ";
-	if(input.geometryShaderInfo.enabled && !vertexOutputs.empty())
-		vertexShader << "out VS_OUT {\n";
-	for(const auto& out : vertexOutputs)
-		vertexShader << outVarPrefix << out << ";\n";
-	vertexShader << ((input.geometryShaderInfo.enabled && !vertexOutputs.empty()) ? "};\n" : "");
-	vertexShader << input.vertexFunctionsCode << std::endl;
-	vertexShader << "void main()\n{\n" << vertexLocalsString.str() << "\n" << input.vertexCode << vertexToFragmentPassingCode.str() << "}\n";
+	{
+		std::ostringstream shader;
+		shader << globals[kVertexIndex].str() << std::endl;
+		shader << vertexInputsString.str() << std::endl;
+		shader << outputInterfaces[kVertexIndex];
+		declarations.stages[kVertexIndex].header = shader.str();
+		declarations.stages[kVertexIndex].locals = locals[kVertexIndex].str() + "\n";
+		declarations.stages[kVertexIndex].epilogue = vertexToFragmentPassingCode.str();
+	}
+
+	//generate tessellation shaders
+	{
+		const ProgramGenerator::TessInfo& info = input.tessellationInfo;
+		std::ostringstream control, evaluation;
+		control << "layout(vertices = " << info.mPatchVertices << ") out;\n";
+		control << globals[kTessControlIndex].str() << std::endl;
+		control << inputInterfaces[kTessControlIndex] << outputInterfaces[kTessControlIndex];
+		evaluation << "layout(" << info.mPrimitive << ", " << info.mSpacing << ", " << info.mOrdering << ") in;\n";
+		evaluation << globals[kTessEvaluationIndex].str() << std::endl;
+		evaluation << inputInterfaces[kTessEvaluationIndex] << outputInterfaces[kTessEvaluationIndex];
+		declarations.stages[kTessControlIndex].header = control.str();
+		declarations.stages[kTessControlIndex].locals = locals[kTessControlIndex].str() + "\n";
+		declarations.stages[kTessEvaluationIndex].header = evaluation.str();
+		declarations.stages[kTessEvaluationIndex].locals = locals[kTessEvaluationIndex].str() + "\n";
+	}
+
+	//generate geometry shader
+	{
+		std::ostringstream shader;
+		shader << "layout(" << input.geometryShaderInfo.mInPrimitive;
+		if(input.geometryShaderInfo.mInvocations > 1)
+			shader << ", invocations = " << input.geometryShaderInfo.mInvocations;
+		shader << ") in;\n";
+		shader << "layout(" << input.geometryShaderInfo.mOutPrimitive <<
+			", max_vertices = " << input.geometryShaderInfo.mMaxVertices << ") out;\n";
+		shader << globals[kGeometryIndex].str() << std::endl;
+		shader << inputInterfaces[kGeometryIndex] << outputInterfaces[kGeometryIndex];
+		declarations.stages[kGeometryIndex].header = shader.str();
+		declarations.stages[kGeometryIndex].locals = "\n" + locals[kGeometryIndex].str();
+		declarations.stages[kGeometryIndex].epilogue = "\n";
+	}
 
 	//generate fragment shader
-	if(input.geometryShaderInfo.enabled && !geometryOutputs.empty())
 	{
-		fragmentShader << "in GS_OUT {\n";
-		for(const auto& in : geometryOutputs)
-			fragmentShader << inVarPrefix << in << ";\n";
-	} else
-		for(const auto& in : vertexOutputs)
-			fragmentShader << inVarPrefix << in << ";\n";
+		std::ostringstream shader;
+		shader << inputInterfaces[kFragmentIndex];
+		shader << fragmentOutputsString.str() << std::endl;
+		shader << globals[kFragmentIndex].str() << std::endl;
+		declarations.stages[kFragmentIndex].header = shader.str();
+		declarations.stages[kFragmentIndex].locals = locals[kFragmentIndex].str() + "\n";
+	}
+	for(size_t i = 0; i < kStageCount; i++)
+		declarations.stages[i].localNames = std::move(localNames[i]);
 
-	fragmentShader << ((input.geometryShaderInfo.enabled && !geometryOutputs.empty()) ? "};\n" : "");
+	if(reflection)
+	{
+		auto byName = [](const ReflectedVariable& a, const ReflectedVariable& b){return a.name < b.name;};
+		std::sort(reflected.varyings.begin(), reflected.varyings.end(), byName);
+		*reflection = std::move(reflected);
+	}
+	return declarations;
+}
 
-	fragmentShader << fragmentOutputsString.str() << std::endl;
-	fragmentShader << fragmentGlobalsString.str() << std::endl;
-	fragmentShader << input.fragmentFunctionsCode << std::endl;
-	fragmentShader << "void main()\n{\n" << fragmentLocalsString.str() << "\n" << input.fragmentCode << "}\n";
+static bool IsGlslIdentifierCharacter(char c)
+{
+	return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
 
-	//generate geometry shader
-	geometryShader << geometryLayout.str() << geometryGlobalsString.str() << std::endl;
-	if(!vertexOutputs.empty())
-		geometryShader << "in VS_OUT {\n";
-	for(const auto& in : vertexOutputs)
-		geometryShader << "\t" << in << ";\n";
-	geometryShader << ((!vertexOutputs.empty()) ? "} gs_in[];\n" : "");
-
-	if(!geometryOutputs.empty())
-		geometryShader << "out GS_OUT {\n";
-	for(const auto& out : geometryOutputs)
-		geometryShader << "\t" << out << ";\n";
-	geometryShader << ((!geometryOutputs.empty()) ?  "} gs_out;\n" : "");
-
-	geometryShader << input.geometryFunctionsCode << std::endl;
-	geometryShader << "void main()\n{\n" <<  "\n" << geometryLocalsString.str();
+/// Remove comments, keeping line breaks so that preprocessor directives stay on their own lines
+static std::string StripGlslComments(const std::string& text)
+{
+	std::string stripped;
+	stripped.reserve(text.size());
+	for(size_t i = 0; i < text.size();)
+	{
+		if(text.compare(i, 2, "//") == 0)
+			i = std::min(text.find('\n', i), text.size());
+		else if(text.compare(i, 2, "/*") == 0)
+		{
+			size_t end = std::min(text.find("*/", i + 2), text.size());
+			stripped += ' ';
+			if(std::count(text.begin() + i, text.begin() + end, '\n'))
+				stripped += '\n';
+			i = std::min(end + 2, text.size());
+		}
+		else
+			stripped += text[i++];
+	}
+	return stripped;
+}
+
+/// Short identifier number n: "a" to "Z", then "aa" etc., skipping keywords
+static std::string ShortGlslName(size_t n)
+{
+	static const char kFirst[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	static const char kOther[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+	const size_t firstCount = sizeof(kFirst) - 1, otherCount = sizeof(kOther) - 1;
+	std::string name(1, kFirst[n % firstCount]);
+	for(n /= firstCount; n > 0; n = (n - 1) / otherCount)
+		name += kOther[(n - 1) % otherCount];
+	return name;
+}
+
+/// Strip comments and redundant whitespace from a shader, and shorten the names of locals
+/** Renaming is consistent within the shader and only picks names that do not occur in it.
+	Members accessed with '.' and preprocessor directives are never renamed.
+	@param locals Names of variables that are not visible outside of the shader. */
+static std::string MinifyGlsl(const std::string& text, const std::vector<std::string>& locals)
+{
+	static const std::unordered_set<std::string> kKeywords = {"do", "if", "in", "for", "int", "out"};
+	const std::string stripped = StripGlslComments(text);
+
+	std::unordered_set<std::string> identifiers;
+	for(size_t i = 0; i < stripped.size();)
+	{
+		size_t begin = i;
+		while(i < stripped.size() && IsGlslIdentifierCharacter(stripped[i]))
+			i++;
+		if(i == begin)
+			i++;
+		else
+			identifiers.insert(stripped.substr(begin, i - begin));
+	}
+
+	std::unordered_map<std::string, std::string> names;
+	size_t nextName = 0;
+	for(auto& local: locals)
+	{
+		if(!identifiers.count(local) || names.count(local))
+			continue;
+		std::string name;
+		do
+			name = ShortGlslName(nextName++);
+		while(identifiers.count(name) || kKeywords.count(name));
+		if(name.size() < local.size())
+			names[local] = name;
+	}
+
+	std::string minified;
+	minified.reserve(stripped.size());
+	bool space = false, lineStart = true;
+	char previous = 0; // Last character written, ignoring line breaks after directives
+	for(size_t i = 0; i < stripped.size();)
+	{
+		char c = stripped[i];
+		if(c == '\n')
+		{
+			lineStart = true;
+			space = true;
+			i++;
+		}
+		else if(std::isspace(static_cast<unsigned char>(c)))
+		{
+			space = true;
+			i++;
+		}
+		else if(c == '#' && lineStart)
+		{
+			// Copy directives verbatim on their own line
+			size_t end = std::min(stripped.find('\n', i), stripped.size());
+			if(!minified.empty() && minified.back() != '\n')
+				minified += '\n';
+			minified.append(stripped, i, end - i);
+			minified += '\n';
+			previous = 0;
+			space = false;
+			i = end;
+		}
+		else if(IsGlslIdentifierCharacter(c))
+		{
+			size_t begin = i;
+			while(i < stripped.size() && IsGlslIdentifierCharacter(stripped[i]))
+				i++;
+			std::string token = stripped.substr(begin, i - begin);
+			if(space && IsGlslIdentifierCharacter(previous))
+				minified += ' ';
+			auto name = names.find(token);
+			if(name != names.end() && previous != '.')
+				token = name->second;
+			minified += token;
+			previous = token.back();
+			space = lineStart = false;
+		}
+		else
+		{
+			// Keep "a - -b" and "a / *b" from becoming different tokens:
+			if(space && ((c == previous && (c == '+' || c == '-' || c == '/')) || (previous == '/' && c == '*')))
+				minified += ' ';
+			minified += c;
+			previous = c;
+			space = lineStart = false;
+			i++;
+		}
+	}
+	if(!minified.empty() && minified.back() != '\n')
+		minified += '\n';
+	return minified;
+}
+
+/// Loop counter of folded geometry shader bodies, see EmitOptions::foldGeometryVertices
+static const char* const kGeometryVertexIndex = "gs_vertex";
+
+/// Replace each "[from]" in text by "[to]"
+static std::string ReplaceIndex(const std::string& text, const std::string& from, const std::string& to)
+{
+	const std::string pattern = "[" + from + "]";
+	std::string result;
+	size_t begin = 0;
+	for(size_t found = text.find(pattern); found != std::string::npos; found = text.find(pattern, begin))
+	{
+		result.append(text, begin, found - begin);
+		result += "[" + to + "]";
+		begin = found + pattern.size();
+	}
+	result.append(text, begin, std::string::npos);
+	return result;
+}
+
+/// Body of main() of the geometry shader as a loop over vertices
+/** @return Empty if the bodies differ in more than the vertex index. */
+static std::string FoldGlslGeometryCode(const ProgramEmitterInput& input, const std::vector<size_t>& primitiveDescription)
+{
+	const std::vector<std::string>& code = input.geometryCode;
+	const bool autoEmission = input.geometryShaderInfo.mEnableAutoEmission;
+	// Only a single primitive can be ended after the loop
+	if(code.size() < 2 || (autoEmission && (primitiveDescription.size() != 1 || primitiveDescription.front() != code.size())))
+		return std::string();
+
+	const std::string folded = ReplaceIndex(code[0], "0", kGeometryVertexIndex);
+	for(size_t i = 1; i < code.size(); i++)
+	{
+		if(ReplaceIndex(folded, kGeometryVertexIndex, std::to_string(i)) != code[i])
+			return std::string();
+	}
+
+	std::ostringstream geometryShader;
+	geometryShader << "\tfor(int " << kGeometryVertexIndex << " = 0; " << kGeometryVertexIndex << " < " << code.size()
+			<< "; " << kGeometryVertexIndex << "++)\n\t{\n";
+	std::istringstream lines(folded);
+	for(std::string line; std::getline(lines, line); )
+	{
+		// Preprocessor directives of uber programs stay at the start of the line
+		const bool blank = line.find_first_not_of(" \t") == std::string::npos;
+		geometryShader << (blank || line[0] == '#' ? "" : "\t") << line << "\n";
+	}
+	geometryShader << "\n";
+	if(autoEmission)
+		geometryShader << "\t\tEmitVertex();\n";
+	geometryShader << "\t}\n";
+	if(autoEmission)
+		geometryShader << "\tEndPrimitive();\n";
+	return geometryShader.str();
+}
+
+/// Body of main() of the geometry shader, including vertex emission
+std::string EmitGlslGeometryCode(const ProgramEmitterInput& input, const ProgramGenerator::EmitOptions& options)
+{
+	std::ostringstream geometryShader;
 	auto primitiveDescription = input.geometryShaderInfo.primitiveDescription;
 	if(!primitiveDescription.size())
 		//by default EndPrimitive after all vertices are emitted
 		primitiveDescription.push_back(input.geometryCode.size());
+	if(options.foldGeometryVertices)
+	{
+		std::string folded = FoldGlslGeometryCode(input, primitiveDescription);
+		if(!folded.empty())
+			return folded;
+	}
 	for(size_t verticesEmitted = 0, i = 0; i < input.geometryCode.size(); i++)
 	{
 		geometryShader << input.geometryCode[i] << "\n";
@@ -296,419 +913,1831 @@ ProgramGenerator::ProgramText EmitGlslProgram(
 		
 		geometryShader << "\tEmitVertex();\n";
 		verticesEmitted++;
-//		LOG(DEBUG) << "verticesEmitted:" << verticesEmitted << " primitiveDescription.front():" << ((primitiveDescription.size() > 0) ?
-//																									 std::to_string(primitiveDescription.front()) :
-//																									 std::string("empty"));
 		if(primitiveDescription.size() && 
 			verticesEmitted == primitiveDescription.front())
 		{
-			std::cout << "Ending Primitive\n";
 			geometryShader << "\tEndPrimitive();\n";
 			verticesEmitted = 0;
 			primitiveDescription.erase(primitiveDescription.begin());
 		}
 	}
-	geometryShader << "\n}\n";
-	
-	ProgramGenerator::ProgramText text;
-	text.vertexShader = vertexShader.str();
-	text.fragmentShader = fragmentShader.str();
-	if(input.geometryShaderInfo.enabled)
-		text.geometryShader = geometryShader.str();
-
-//	LOG(DEBUG) << "VERTEX SHADER:\n" << text.vertexShader << std::endl;
-//	LOG(DEBUG) << "FRAGMENT SHADER:\n" << text.fragmentShader << std::endl;
-//	LOG(DEBUG) << "GEOMETRY SHADER:\n" << (input.geometryShaderInfo.enabled?text.geometryShader:"DISABLED") << std::endl;
-
-	return text;
+	return geometryShader.str();
 }
 
-std::vector<ProgramGenerator::Function*> ProgramGenerator::FindCandidateFunctions(const Variable& candidate, bool highQuality)
+std::string AssembleGlslShader(const ProgramDeclarations::Stage& stage, const std::string& functionsCode, const std::string& code)
 {
-	auto result = mFunctions.equal_range(candidate);
-	// Sort found functions by quality, priority, number of inputs:
-	std::vector<Function*> candidateFunctions;
-	for(auto fIt = result.first; fIt != result.second; ++fIt)
-		candidateFunctions.push_back(&(fIt->second));
+	std::ostringstream shader;
+	// Pure functions end with a line break
+	shader << stage.header << (functionsCode.empty() ? "\n" : functionsCode);
+	shader << "void main()\n{\n" << stage.locals << code << stage.epilogue << "}\n";
+	return shader.str();
+}
 
-	CompareFunctions comparator(highQuality);
-	std::sort(candidateFunctions.begin(), candidateFunctions.end(), comparator);
-	return candidateFunctions;
+/// Shader of each stage in ProgramText, indexed by PipelineIndex()
+static std::string ProgramGenerator::ProgramText::* const kStageTexts[kStageCount] = {
+	&ProgramGenerator::ProgramText::vertexShader,
+	&ProgramGenerator::ProgramText::tessControlShader,
+	&ProgramGenerator::ProgramText::tessEvaluationShader,
+	&ProgramGenerator::ProgramText::geometryShader,
+	&ProgramGenerator::ProgramText::fragmentShader
 };
 
+/// Hash of each stage in ProgramText, indexed by PipelineIndex()
+static uint64_t ProgramGenerator::ProgramText::* const kStageHashes[kStageCount] = {
+	&ProgramGenerator::ProgramText::vertexShaderHash,
+	&ProgramGenerator::ProgramText::tessControlShaderHash,
+	&ProgramGenerator::ProgramText::tessEvaluationShaderHash,
+	&ProgramGenerator::ProgramText::geometryShaderHash,
+	&ProgramGenerator::ProgramText::fragmentShaderHash
+};
 
-ProgramGenerator::ProgramText ProgramGenerator::GenerateProgram(
-		const std::set<Variable>& inputs,
-		const std::set<Variable>& outputs,
-		const std::unordered_map<Variable, int>& inputArraySizes,
-		bool highQuality)
+/// FNV-1a hash of a stage text, never 0 for used stages
+static uint64_t HashStageText(const std::string& text)
 {
-	std::vector<Function*> functions;
-	std::unordered_map<Variable, int> arraySizes = inputArraySizes;
+	if(text.empty())
+		return 0;
+	uint64_t hash = 14695981039346656037ull;
+	for(char c: text)
+		hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+	return hash ? hash : 1;
+}
 
-	// Find execution paths for all outputs:
-	size_t gsAffinity = 0;
-	for(auto it: outputs)
+/// Combine declarations and snippet code to the final GLSL text
+ProgramGenerator::ProgramText AssembleGlslProgram(const ProgramDeclarations& declarations, const ProgramEmitterInput& input, const ProgramGenerator::EmitOptions& options)
+{
+	ProgramGenerator::ProgramText text;
+	for(size_t i = 0; i < kStageCount; i++)
 	{
-		auto foundFunctions = FindFunctions(inputs, it, highQuality, gsAffinity);
-		// Concatenate found functions:
-		functions.insert(functions.end(), foundFunctions.begin(), foundFunctions.end());
+		if(!input.IsEnabled(i))
+			continue;
+		const std::string& code = (i == kGeometryIndex) ? EmitGlslGeometryCode(input, options) : input.stages[i].code;
+		text.*kStageTexts[i] = AssembleGlslShader(declarations.stages[i], input.stages[i].functionsCode, code);
+		if(options.minify)
+			text.*kStageTexts[i] = MinifyGlsl(text.*kStageTexts[i], declarations.stages[i].localNames);
 	}
+	text.capturedVaryings = declarations.capturedVaryings;
+	return text;
+}
 
-	RemoveDuplicates(functions); // Sets duplicates to nullptr
-//	LOG(DEBUG) << printFunctions(functions);
-
-	std::ostringstream vertexCode, fragmentCode, vertexFunctionsCode, fragmentFunctionsCode, geometryFunctionsCode;
-	std::vector<std::ostringstream> geometryCode;
-	ProgramEmitterInput emitterInput;
+/// Convert program generator output to actual GLSL text
+ProgramGenerator::ProgramText EmitGlslProgram(
+		const ProgramEmitterInput& input,
+		const std::set<ProgramGenerator::Variable>& outputs,
+		const std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
+		const SnippetLibrary& variables,
+		const ProgramGenerator::EmitOptions& options)
+{
+	ProgramGenerator::Reflection reflection;
+	ProgramGenerator::ProgramText text = AssembleGlslProgram(EmitGlslDeclarations(input, outputs, arraySizes, variables, options, &reflection), input, options);
+	text.reflection = std::move(reflection);
+	return text;
+}
 
-	// Functions are ordered with outputs first, so reverse:
-	for(auto rit = functions.rbegin(); rit != functions.rend(); ++rit)
+/// Appends snippet code, wrapping it in preprocessor conditionals where requested
+/** Consecutive code with the same condition shares one #if block. */
+class ConditionalCode
+{
+public:
+	/// @param condition Preprocessor expression, empty for unconditional code
+	void Append(const std::string& condition, const std::string& code)
 	{
-		Function* func = *rit;
-		if(!func)
-			continue; // Skip duplicate filtered by RemoveDuplicates()
-		
-		// Write pure function definition to source snippet and continue
+		if(condition != mCondition)
+		{
+			if(!mCondition.empty())
+				mCode << "#endif\n";
+			if(!condition.empty())
+				mCode << "#if " << condition << "\n";
+			mCondition = condition;
+		}
+		mCode << code;
+	}
+
+	std::string str()
+	{
+		Append(std::string(), std::string());
+		return mCode.str();
+	}
+
+private:
+	std::ostringstream mCode;
+	std::string mCondition;
+};
+
+/// Pass through a dense variable index
+/** @throws std::out_of_range if the variable has no VariableInfo. */
+static uint32_t VariableIndex(uint32_t index, ProgramGenerator::Variable variable)
+{
+	if(index == ProgramGenerator::kUnknownVariable)
+	{
+		std::ostringstream oss;
+		oss << "Shader variable \"<unknown 0x" << std::hex << variable << ">\" used without declaration";
+		throw std::out_of_range(oss.str());
+	}
+	return index;
+}
+
+/// Sort resolved functions into the emitter input
+/** @param functions Functions in emission order, i.e. dependencies first.
+	@param conditions Preprocessor conditions for functions that are not always emitted. */
+void CollectEmitterInput(
+		const std::vector<const ProgramGenerator::Snippet*>& functions,
+		const ProgramGenerator::InputFunctionMap& inputFunctions,
+		const std::set<ProgramGenerator::Variable>& inputs,
+		const SnippetLibrary& variables,
+		std::unordered_map<ProgramGenerator::Variable, int>& arraySizes,
+		ProgramEmitterInput& emitterInput,
+		const std::unordered_map<const ProgramGenerator::Snippet*, std::string>* conditions = nullptr)
+{
+	ConditionalCode code[kStageCount], functionsCode[kStageCount];
+	std::vector<ConditionalCode> geometryCode;
+	const std::string unconditional;
+
+	for(const ProgramGenerator::Snippet* func: functions)
+	{
+		const std::string& condition = conditions && conditions->count(func) ? conditions->at(func) : unconditional;
+		const size_t stage = PipelineIndex(func->stage);
+
+		// Write pure function definition to source snippet and continue
 		if(func->pureFunction)
 		{
-			if(func->stage == Function::Stage::kVertexStage)
-				vertexFunctionsCode << func->source[0];
-			else if(func->stage == Function::Stage::kVertexStage)
-				fragmentFunctionsCode << func->source[0];
-			else
-				geometryFunctionsCode << func->source[0];
+			functionsCode[stage].Append(condition, *func->source[0] + "\n");
 			continue;
 		}
-			
 
 		// Set output array size from input array size:
-		VariableMap::iterator iit = mVariableInfos.find(func->output);
-		if(iit != mVariableInfos.end() && iit->second.array)
+		uint32_t output = VariableIndex(func->outputIndex, func->output);
+		if(variables.GetVariable(output).array)
 		{
 			// TODO: error checking
 			arraySizes[func->output] = arraySizes[func->outputArraySizeSource];
 		}
 
 		// Write function code and collect all function outputs:
-		if(func->stage == Function::Stage::kVertexStage)
-		{
-			vertexCode << "\t" << func->source[0] << std::endl;
-			emitterInput.vertexLocals.insert(func->output);
-		}
-		else if(func->stage == Function::Stage::kFragmentStage)
-		{
-			fragmentCode << "\t" << func->source[0] << std::endl;
-			emitterInput.fragmentLocals.insert(func->output);
-		} 
-		else
+		if(stage == kGeometryIndex)
 		{
 			if(geometryCode.size() == 0)
 				geometryCode.resize(func->source.size());
 			assert(geometryCode.size() == func->source.size());
 			for(size_t i = 0; i < geometryCode.size(); i++)
 			{
-				geometryCode[i] << "\t" << func->source[i] << std::endl;
+				geometryCode[i].Append(condition, "\t" + *func->source[i] + "\n");
 			}
-			emitterInput.geometryLocals.insert(func->output);
 			if(func->gsInfo)
 				emitterInput.geometryShaderInfo = *func->gsInfo;
 			emitterInput.geometryShaderInfo.enabled = true;
 		}
+		else
+		{
+			code[stage].Append(condition, "\t" + *func->source[0] + "\n");
+			if(stage == kTessControlIndex || stage == kTessEvaluationIndex)
+			{
+				// The control stage sets up the patch, the evaluation stage the tessellator
+				ProgramGenerator::TessInfo& info = emitterInput.tessellationInfo;
+				if(func->tessInfo && stage == kTessControlIndex)
+					info.mPatchVertices = func->tessInfo->mPatchVertices;
+				else if(func->tessInfo)
+				{
+					info.mPrimitive = func->tessInfo->mPrimitive;
+					info.mSpacing = func->tessInfo->mSpacing;
+					info.mOrdering = func->tessInfo->mOrdering;
+				}
+				info.enabled = true;
+			}
+		}
+		emitterInput.stages[stage].locals.insert(output);
 
 		// Collect all function inputs:
-		for(auto it: func->inputs)
+		auto funcInputFunctions = inputFunctions.find(func);
+		for(size_t i = 0; i < func->inputs.size(); i++)
 		{
-			auto inputFunction = func->inputFunctions.find(it);
-			if(inputFunction != func->inputFunctions.end() && inputFunction->second->pureFunction)
-				continue;
-			
-			if(func->stage == Function::Stage::kVertexStage)
+			ProgramGenerator::Variable var = func->inputs[i];
+			if(funcInputFunctions != inputFunctions.end())
 			{
-				if(inputs.count(it))
-					emitterInput.vertexInputs.insert(it);
-				else
-					emitterInput.vertexLocals.insert(it);
+				auto inputFunction = funcInputFunctions->second.find(var);
+				if(inputFunction != funcInputFunctions->second.end() && inputFunction->second->pureFunction)
+					continue;
 			}
-			else if(func->stage == Function::Stage::kFragmentStage)
+
+			uint32_t it = VariableIndex(func->inputIndices[i], var);
+			if(!inputs.count(var))
+				emitterInput.stages[stage].locals.insert(it);
+			else if(stage == kFragmentIndex && emitterInput.IsAttribute(variables.GetVariable(it)))
 			{
-				if(inputs.count(it))
-				{
-					const VariableInfo& info = mVariableInfos.at(it);
-					if(info.usage == VariableInfo::Usage::kAttribute)
-					{
-						// Attribute needed in fragment shader
-						emitterInput.fragmentAttributes.insert(it);
-						emitterInput.vertexInputs.insert(it);
-						emitterInput.fragmentLocals.insert(it);
-					}
-					else
-						emitterInput.fragmentUniforms.insert(it);
-				}
-				else
-					emitterInput.fragmentLocals.insert(it);
+				// Attribute needed in fragment shader
+				emitterInput.fragmentAttributes.insert(it);
+				emitterInput.stages[kVertexIndex].inputs.insert(it);
+				emitterInput.stages[kFragmentIndex].locals.insert(it);
 			}
+			else if(stage != kVertexIndex && emitterInput.capturedAttributes.count(var))
+				throw std::invalid_argument("Captured variable \"" + *variables.GetVariable(it).name + "\" can only be read by the vertex and fragment stages");
 			else
-			{
-				if(inputs.count(it))
-					emitterInput.geometryUniforms.insert(it);
-				else
-					emitterInput.geometryLocals.insert(it);
-			}
+				emitterInput.stages[stage].inputs.insert(it);
 		}
 	}
 
-	if(emitterInput.vertexInputs.empty())
-		LOG(WARNING) << "No vertex inputs used out of " << ToString(inputs);
-
-	emitterInput.vertexCode = vertexCode.str();
-	emitterInput.fragmentCode = fragmentCode.str();
-	emitterInput.vertexFunctionsCode = vertexFunctionsCode.str();
-	emitterInput.fragmentFunctionsCode = fragmentFunctionsCode.str();
-	emitterInput.geometryFunctionsCode = geometryFunctionsCode.str();
+	for(size_t i = 0; i < kStageCount; i++)
+	{
+		emitterInput.stages[i].code = code[i].str();
+		emitterInput.stages[i].functionsCode = functionsCode[i].str();
+	}
 	emitterInput.geometryCode.resize(geometryCode.size());
 	for(size_t i = 0; i < emitterInput.geometryCode.size(); i++)
 		emitterInput.geometryCode[i] = geometryCode[i].str();
-	return EmitGlslProgram(
-			emitterInput,
-			outputs,
-			arraySizes,
-			mVariableInfos);
 }
 
-void ProgramGenerator::AddFunction(const Function& function)
+/// Estimate the cost of each enabled stage of a program
+ProgramGenerator::CostReport EstimateCosts(
+		const std::vector<const ProgramGenerator::Snippet*>& functions,
+		const ProgramEmitterInput& input,
+		const std::set<ProgramGenerator::Variable>& outputs,
+		const SnippetLibrary& variables)
 {
-	mFunctions.insert(std::make_pair(function.output, function));
-}
+	ProgramGenerator::StageCost stages[kStageCount];
+	for(size_t i = 0; i < kStageCount; i++)
+		stages[i].stage = kPipeline[i];
 
-ProgramGenerator::Variable ProgramGenerator::AddVariable(const char* name, const char* type, bool array, VariableInfo::Usage usage)
-{
-	return AddVariable(VariableInfo(name, type, array, usage));
-}
+	for(auto function: functions)
+	{
+		ProgramGenerator::StageCost& stage = stages[PipelineIndex(function->stage)];
+		stage.functions.push_back(function);
+		stage.cost += function->cost;
+		stage.textureSamples += function->textureSamples;
+	}
 
-ProgramGenerator::Variable ProgramGenerator::AddVariable(const VariableInfo& variable)
-{
-	Variable hash = HashUtils::MakeHash(variable.name);
-//#ifndef NDEBUG
-	VariableMap::iterator it = mVariableInfos.find(hash);
-	if(it != mVariableInfos.end())
+	// Count declarations like EmitGlslDeclarations() does:
+	const std::unordered_map<uint32_t, size_t> producers = FindProducers(input);
+	unsigned interfaces[kStageCount] = {};
+	for(size_t i = 0; i < kStageCount; i++)
+	{
+		for(auto it: input.stages[i].inputs)
+		{
+			if(i == kVertexIndex && input.IsAttribute(variables.GetVariable(it)))
+				stages[i].attributes++;
+			else if(!(input.constants && input.constants->count(variables.GetVariable(it).hash)))
+				stages[i].uniforms++;
+		}
+
+		for(auto it: input.stages[i].locals)
+		{
+			const auto& info = variables.GetVariable(it);
+			if((i == kFragmentIndex && outputs.count(info.hash)) || !strncmp(info.name->data(), "gl_", 3))
+				continue;
+			if(producers.at(it) == i && UsedLater(input, i, it))
+				interfaces[i]++;
+		}
+	}
+	stages[kVertexIndex].outputVaryings += input.fragmentAttributes.size();
+	stages[kFragmentIndex].inputVaryings += input.fragmentAttributes.size();
+
+	ProgramGenerator::CostReport report;
+	for(size_t i = 0; i < kStageCount; i++)
 	{
-		VariableInfo& oldVar = it->second;
-		if(oldVar.name != variable.name)
-			LOG(ERROR) << "Hash collision: " << oldVar.name << " vs. " << variable.name;
-		if(oldVar.type != variable.type)
-			throw(std::runtime_error(std::string("Existing shader variable \"") + variable.name + "\" declared with different type"));
-		if(oldVar.usage != variable.usage)
-			throw(std::runtime_error(std::string("Existing shader variable \"") + variable.name + "\" declared with different usage"));
+		if(!input.IsEnabled(i))
+			continue;
+		if(interfaces[i])
+		{
+			size_t next = i + 1;
+			while(!input.IsEnabled(next))
+				next++;
+			stages[i].outputVaryings += interfaces[i];
+			stages[next].inputVaryings += interfaces[i];
+		}
+		report.push_back(std::move(stages[i]));
 	}
-//#endif
-	mVariableInfos[hash] = variable;
-	return hash;
+	return report;
 }
 
-std::vector<ProgramGenerator::Function*> ProgramGenerator::FindFunctions(const std::set<Variable>& inputs, Variable output, bool highQuality, size_t& baseGSAffinity)
+std::vector<const ProgramGenerator::SnippetRecord*> ProgramGenerator::FindCandidateFunctions(const Variable& candidate, const Constants& constants, bool highQuality) const
 {
-	struct StackItem
+	std::vector<const SnippetRecord*> candidateFunctions;
+	mSnippets->FindRecords(candidate, candidateFunctions);
+
+	// Drop functions specialized for values that are not known, or for other values:
+	auto unspecialized = [&](const SnippetRecord* function)
 	{
-		ProgramGenerator::Function* function;
-		std::vector<ProgramGenerator::Function*> functions;
-		std::vector<ProgramGenerator::Function*> candidateFunctions;
-		std::vector<Variable> inputs;
-		size_t gsAffinity;
+		if(!function->specializationCount)
+			return false;
+		for(auto& specialization: function->snippet->specializations)
+		{
+			auto constant = constants.find(specialization.first);
+			if(constant == constants.end() || constant->second != specialization.second)
+				return true;
+		}
+		return false;
 	};
+	candidateFunctions.erase(std::remove_if(candidateFunctions.begin(), candidateFunctions.end(), unspecialized), candidateFunctions.end());
+
+	// Sort found functions by quality, priority, number of inputs:
+	CompareFunctions comparator(highQuality);
+	std::stable_sort(candidateFunctions.begin(), candidateFunctions.end(), comparator);
+	return candidateFunctions;
+};
+
 
-	auto invalidDependence = [](const std::vector<StackItem>& executionPathStack,
-								ProgramGenerator::Function* function)
+/// Declarations of all combinations of an uber program
+/** Each text is stored once, together with a mask of the combinations that use it. */
+struct UberDeclarations
+{
+	typedef std::vector<std::pair<std::string, uint64_t>> Alternatives;
+	struct Stage
 	{
+		Alternatives header, locals, epilogue;
+	};
+
+	/// Stages, indexed by PipelineIndex()
+	Stage stages[kStageCount];
+};
 
-		for(auto item : executionPathStack)
+static void AddAlternative(UberDeclarations::Alternatives& alternatives, const std::string& text, uint64_t combination)
+{
+	for(auto& alternative: alternatives)
+	{
+		if(alternative.first == text)
 		{
-			//check dependency loop
-			if(item.function == function)
-				return true;
-			
-			//check conflicting dependency
-			if(item.function->stage == function->stage && 
-					item.function->name == function->name)
-				return true;
+			alternative.second |= combination;
+			return;
 		}
+	}
+	alternatives.push_back(std::make_pair(text, combination));
+}
 
-		if(!executionPathStack.empty())
-		{
-			//check backward pipline dependency
-			auto parrentFunction = executionPathStack.back().function;
-			if(	(parrentFunction->stage == ProgramGenerator::Function::Stage::kVertexStage ||
-					parrentFunction->stage == ProgramGenerator::Function::Stage::kGeometryStage) &&
-					function->stage == ProgramGenerator::Function::Stage::kFragmentStage)
-				return true;
-			else if(parrentFunction->stage == ProgramGenerator::Function::Stage::kVertexStage &&
-					function->stage == ProgramGenerator::Function::Stage::kGeometryStage)
-				return true;
-			
-			//check dependency from fragment to vertex stage with enabled geometry stage
-			if(function->stage == ProgramGenerator::Function::Stage::kVertexStage &&
-					parrentFunction->stage == ProgramGenerator::Function::Stage::kFragmentStage &&
-					executionPathStack.back().gsAffinity)
-				return true;
+static void AddAlternatives(UberDeclarations::Stage& alternatives, const ProgramDeclarations::Stage& stage, uint64_t combination)
+{
+	AddAlternative(alternatives.header, stage.header, combination);
+	AddAlternative(alternatives.locals, stage.locals, combination);
+	AddAlternative(alternatives.epilogue, stage.epilogue, combination);
+}
 
-			//check dependency on pure function within different pipline stage
-			if(function->pureFunction && function->stage != executionPathStack.back().function->stage)
-				return true;
+/// Preprocessor expression that is true for the given combinations of defines
+/** Bit c of combinations stands for the combination in which defines[i] is set if bit i of c
+	is set. Combinations outside of validMask never occur, which keeps the expression short. */
+static std::string CombinationCondition(uint64_t combinations, uint64_t validMask, const std::vector<std::string>& defines)
+{
+	combinations &= validMask;
+	if(combinations == validMask)
+		return std::string();
+
+	const size_t combinationCount = size_t(1) << defines.size();
+	for(size_t i = 0; i < defines.size(); i++)
+	{
+		uint64_t withDefine = 0;
+		for(size_t c = 0; c < combinationCount; c++)
+		{
+			if(c & (size_t(1) << i))
+				withDefine |= uint64_t(1) << c;
 		}
-		
-		
-		return false;
-	};
+		withDefine &= validMask;
+		if(combinations == withDefine)
+			return "defined(" + defines[i] + ")";
+		else if(combinations == (validMask & ~withDefine))
+			return "!defined(" + defines[i] + ")";
+	}
 
-	std::vector<StackItem> executionPathStack;
-	StackItem currentState = {nullptr, {}, FindCandidateFunctions(output, highQuality), {}, baseGSAffinity};
-	while(true)
+	std::string condition;
+	for(size_t c = 0; c < combinationCount; c++)
 	{
-		assert(currentState.functions.empty() || executionPathStack.empty());
-		if(currentState.candidateFunctions.empty())
+		if(!(combinations & (uint64_t(1) << c)))
+			continue;
+		condition += condition.empty() ? "(" : " || (";
+		for(size_t i = 0; i < defines.size(); i++)
 		{
-			if(!executionPathStack.empty())
-			{
-				// All candidates for this input discarded, thus the parrent function failed to find a candidate for its input.
-				// Start processing the next candidate for a parrent
-				currentState = std::move(executionPathStack.back());
-				currentState.functions.clear();
-				executionPathStack.pop_back();
-				continue;
-			} else
-				// We are back to the root. Finish processing execution path tree
-				break;
+			if(i)
+				condition += " && ";
+			condition += ((c & (size_t(1) << i)) ? "defined(" : "!defined(") + defines[i] + ")";
 		}
+		condition += ")";
+	}
+	return condition;
+}
 
-		// Before processing candidate function restore its geometry stage affinity
-		if(!executionPathStack.empty())
-			// Inherit gsAffinity from parrent
-			currentState.gsAffinity = executionPathStack.back().gsAffinity;
-		else
-			// It is a root of the tree. Set its gs affinity to initial value
-			currentState.gsAffinity = baseGSAffinity;
+/// Join alternative texts into an #if/#elif chain
+static std::string MergeAlternatives(const UberDeclarations::Alternatives& alternatives, uint64_t validMask, const std::vector<std::string>& defines)
+{
+	if(alternatives.size() == 1)
+		return alternatives.front().first;
 
-		currentState.function = currentState.candidateFunctions.front();
-		currentState.candidateFunctions.erase(currentState.candidateFunctions.begin());
-		
-		// Handle invalid dependency. If detected, check next candidate
-		if(invalidDependence(executionPathStack, currentState.function))
+	std::ostringstream oss;
+	bool first = true;
+	for(auto& alternative: alternatives)
+	{
+		if(alternative.first.empty())
 			continue;
-		
-		// Check GS affinity if not pure function
-		if(!currentState.function->pureFunction)
+		oss << (first ? "#if " : "#elif ") << CombinationCondition(alternative.second, validMask, defines) << "\n";
+		oss << alternative.first;
+		if(alternative.first.back() != '\n')
+			oss << "\n";
+		first = false;
+	}
+	if(!first)
+		oss << "#endif\n";
+	return oss.str();
+}
+
+static ProgramDeclarations::Stage MergeAlternatives(const UberDeclarations::Stage& alternatives, uint64_t validMask, const std::vector<std::string>& defines)
+{
+	ProgramDeclarations::Stage stage;
+	stage.header = MergeAlternatives(alternatives.header, validMask, defines);
+	stage.locals = MergeAlternatives(alternatives.locals, validMask, defines);
+	stage.epilogue = MergeAlternatives(alternatives.epilogue, validMask, defines);
+	return stage;
+}
+
+/// State of a finished search, for reusing it in UpdateProgram()
+struct ProgramGenerator::Resolution
+{
+	/// Inputs of all candidates of each variable the search looked at
+	std::unordered_map<Variable, std::vector<Variable>> dependencies;
+	/// Variables that can be derived from the inputs
+	std::unordered_set<Variable> derivable;
+	/// Function bound to each variable, see Resolver
+	std::map<std::pair<Variable, int>, const SnippetRecord*> bindings;
+};
+
+ProgramGenerator::ProgramText ProgramGenerator::GenerateProgram(
+		const std::set<Variable>& inputs,
+		const std::set<Variable>& outputs,
+		const std::unordered_map<Variable, int>& arraySizes,
+		bool highQuality,
+		const Constants& constants,
+		CostReport* costReport)
+{
+	if(!mProgramCache || costReport)
+		return Generate(inputs, outputs, arraySizes, highQuality, constants, false, costReport).text;
+
+	// Key: library fingerprint, emit options and canonical request
+	if(mFingerprintRevision != mRevision)
+	{
+		mFingerprint = mSnippets->GetFingerprint();
+		mFingerprintRevision = mRevision;
+	}
+	std::string key(8, '\0');
+	for(int i = 0; i < 8; i++)
+		key[i] = static_cast<char>(mFingerprint >> (i * 8));
+	key += static_cast<char>((mEmitOptions.explicitLocations ? 1 : 0) | (mEmitOptions.minify ? 2 : 0)
+			| (mEmitOptions.foldGeometryVertices ? 4 : 0) | (mEmitOptions.separable ? 8 : 0));
+	encoding::Writer request;
+	request.Byte(encoding::kVersion);
+	encoding::WriteRequest(request, inputs, outputs, arraySizes, highQuality, constants);
+	key += request.Data();
+
+	std::string value;
+	if(mProgramCache->Find(key, value))
+	{
+		try
 		{
-			if(currentState.gsAffinity != 0 && 
-				currentState.function->stage == Function::Stage::kGeometryStage &&
-				currentState.function->source.size() != currentState.gsAffinity)
-				//This function is not aligned with general geometry shader affinity (number of vertex outputs)
-				continue;
-			else if(currentState.gsAffinity == 0 && 
-					currentState.function->stage == Function::Stage::kGeometryStage)
-				//in case if it is first geometry stage function met on the path, make affinity fit number of sources
-				currentState.gsAffinity = currentState.function->source.size();
+			mLastSearchStats = SearchStats();
+			ProgramText text = encoding::DecodeProgram(value);
+			InternStages(text);
+			return text;
 		}
-		
-		currentState.inputs = currentState.function->inputs;
-		currentState.functions = {currentState.function};
-		while(true)
+		catch(std::runtime_error&)
 		{
+			// Written by another version, generate and replace it
+		}
+	}
+	ProgramText text = Generate(inputs, outputs, arraySizes, highQuality, constants, false, nullptr).text;
+	try
+	{
+		mProgramCache->Insert(key, encoding::EncodeProgram(text));
+	}
+	catch(std::runtime_error&)
+	{
+		// The cache is optional, e.g. on a full disk the program is just not stored
+	}
+	return text;
+}
 
-			if(currentState.inputs.empty())
-			{
-				// Finish processing of inputs				
+ProgramGenerator::ProgramText ProgramGenerator::GenerateCaptureProgram(
+		const std::set<Variable>& inputs,
+		const std::vector<Variable>& captured,
+		const std::unordered_map<Variable, int>& arraySizes,
+		bool highQuality,
+		const Constants& constants)
+{
+	for(auto variable: captured)
+	{
+		if(inputs.count(variable) || constants.count(variable))
+			throw std::invalid_argument("Captured variable \"" + ToString(variable) + "\" is an input");
+	}
+	CaptureRequest capture;
+	capture.variables = captured;
+	const std::set<Variable> outputs(captured.begin(), captured.end());
+	return Generate(inputs, outputs, arraySizes, highQuality, constants, false, nullptr, nullptr, std::set<Variable>(), &capture).text;
+}
 
-				if(executionPathStack.empty())
-				{
-					if(!currentState.functions.empty())
-						// We are back to a root function, and execution path is found. 
-						// Finish tree traversal by clearing all candidate functions
-						currentState.candidateFunctions.clear();
-					break;
-				}
-				
-				if(!currentState.functions.empty())
-				{
-					// This trunk has acceptable dependencys, 
-					// thus pass all found functions to parrent node and 
-					// continue processing other parrent inputs 
-					executionPathStack.back().functions.insert(executionPathStack.back().functions.end(),
-																currentState.functions.begin(),
-																currentState.functions.end());
-					executionPathStack.back().gsAffinity = currentState.gsAffinity;
-					executionPathStack.back().function->inputFunctions[currentState.function->output] = currentState.function;
-					currentState = std::move(executionPathStack.back());
-					executionPathStack.pop_back();
-					continue;
-					
-				} else
-					// Current candidate has no valid dependency chain, process next candidate
-					break;
-			}
+ProgramGenerator::ProgramText ProgramGenerator::GenerateReplayProgram(
+		const std::set<Variable>& inputs,
+		const std::set<Variable>& captured,
+		const std::set<Variable>& outputs,
+		const std::unordered_map<Variable, int>& arraySizes,
+		bool highQuality,
+		const Constants& constants)
+{
+	for(auto variable: captured)
+	{
+		if(ToString(variable).compare(0, 3, "gl_") == 0)
+			throw std::invalid_argument("Built-in variable \"" + ToString(variable) + "\" cannot be read as an attribute");
+	}
+	CaptureRequest capture;
+	capture.variables.assign(captured.begin(), captured.end());
+	capture.replay = true;
+	return Generate(inputs, outputs, arraySizes, highQuality, constants, false, nullptr, nullptr, std::set<Variable>(), &capture).text;
+}
 
-			// Process next input
-			auto input = currentState.inputs.front();
-			currentState.inputs.erase(currentState.inputs.begin());
+ProgramGenerator::Generation ProgramGenerator::GenerateIncrementalProgram(
+		const std::set<Variable>& inputs,
+		const std::set<Variable>& outputs,
+		const std::unordered_map<Variable, int>& arraySizes,
+		bool highQuality,
+		const Constants& constants)
+{
+	return Generate(inputs, outputs, arraySizes, highQuality, constants, true, nullptr);
+}
 
-			if(!inputs.count(input))
-			{
-				auto newCandidateFunctions = FindCandidateFunctions(input, highQuality);
-				if(!newCandidateFunctions.empty())
-				{
-					// Push current state and start processing new trunk
-					executionPathStack.push_back(currentState);
-					currentState = StackItem();
-					currentState.gsAffinity = executionPathStack.back().gsAffinity;
-					currentState.candidateFunctions = std::move(newCandidateFunctions);
-					break;
-				} else
-				{
-					// This input is not in shader-inputs, and has no candidates. Process next candidate
-					currentState.functions.clear();
-					break;
-				}
-			}
-			// Exit loops at the beginnig
-		}
+ProgramGenerator::Generation ProgramGenerator::UpdateProgram(const Generation& previous, const ProgramDelta& delta)
+{
+	if(previous.mGenerator != this)
+		throw std::invalid_argument("Generation was created by another generator");
+
+	std::set<Variable> inputs = previous.inputs;
+	std::set<Variable> changedInputs;
+	for(auto it: delta.removedInputs)
+	{
+		if(inputs.erase(it))
+			changedInputs.insert(it);
+	}
+	for(auto it: delta.addedInputs)
+	{
+		if(inputs.insert(it).second)
+			changedInputs.insert(it);
+	}
+
+	std::set<Variable> outputs = previous.outputs;
+	for(auto it: delta.removedOutputs)
+		outputs.erase(it);
+	outputs.insert(delta.addedOutputs.begin(), delta.addedOutputs.end());
+
+	return Generate(inputs, outputs, previous.arraySizes, previous.highQuality, previous.constants, true, nullptr, &previous, changedInputs);
+}
+
+ProgramGenerator::Generation ProgramGenerator::Generate(
+		const std::set<Variable>& inputs,
+		const std::set<Variable>& outputs,
+		const std::unordered_map<Variable, int>& inputArraySizes,
+		bool highQuality,
+		const Constants& constants,
+		bool incremental,
+		CostReport* costReport,
+		const Generation* previous,
+		const std::set<Variable>& changedInputs,
+		const CaptureRequest* capture)
+{
+	if(!mSnippets->IsFrozen())
+		mSnippets->Freeze();
+
+	// Constants are available like any other input:
+	std::set<Variable> constantVariables;
+	for(auto& it: constants)
+	{
+		const SnippetVariable* info = mSnippets->FindVariable(it.first);
+		if(info && info->usage == VariableInfo::Usage::kAttribute)
+			throw std::invalid_argument("Attribute \"" + *info->name + "\" cannot be a constant");
+		constantVariables.insert(it.first);
+	}
+	std::set<Variable> allInputs = inputs;
+	allInputs.insert(constantVariables.begin(), constantVariables.end());
+	// Replayed variables are read from the captured buffer:
+	if(capture && capture->replay)
+		allInputs.insert(capture->variables.begin(), capture->variables.end());
+
+	// Choices of a previous generation are only valid while no functions were added
+	const Resolution* previousResolution = nullptr;
+	if(previous && previous->mRevision == mRevision)
+		previousResolution = previous->mResolution.get();
+	std::shared_ptr<Resolution> resolution;
+	if(incremental)
+		resolution = std::make_shared<Resolution>();
+
+	InputFunctionMap inputFunctions;
+	auto functions = ResolveOutputs(allInputs, constants, outputs, highQuality, inputFunctions, resolution.get(), previousResolution, changedInputs);
+
+	std::unordered_map<Variable, int> arraySizes = inputArraySizes;
+	ProgramEmitterInput emitterInput;
+	emitterInput.constants = &constants;
+	if(capture && capture->replay)
+		emitterInput.capturedAttributes.insert(capture->variables.begin(), capture->variables.end());
+	else if(capture)
+		emitterInput.captured = capture->variables;
+	CollectEmitterInput(functions, inputFunctions, allInputs, *mSnippets, arraySizes, emitterInput);
+
+	if(Reports(Diagnostic::Level::kDebug))
+	{
+		for(auto function: functions)
+			Report(Diagnostic::Level::kDebug, Diagnostic::Event::kFunctionSelected, function->output, function);
+	}
+	if(emitterInput.stages[kVertexIndex].inputs.empty() && Reports(Diagnostic::Level::kWarning))
+		Report(Diagnostic::Level::kWarning, Diagnostic::Event::kNoVertexInputs);
+	if(costReport)
+		*costReport = EstimateCosts(functions, emitterInput, outputs, *mSnippets);
+
+	Generation generation;
+	generation.text = EmitGlslProgram(
+			emitterInput,
+			outputs,
+			arraySizes,
+			*mSnippets,
+			mEmitOptions);
+	InternStages(generation.text);
+	if(!incremental)
+		return generation;
+
+	for(size_t i = 0; i < kStageCount; i++)
+	{
+		const std::string& text = generation.text.*kStageTexts[i];
+		if(previous ? text != previous->text.*kStageTexts[i] : !text.empty())
+			generation.changedStages.push_back(kPipeline[i]);
 	}
-	
-	assert(executionPathStack.empty());
-	baseGSAffinity = currentState.gsAffinity;
-	return currentState.functions;
+	generation.inputs = inputs;
+	generation.outputs = outputs;
+	generation.arraySizes = inputArraySizes;
+	generation.highQuality = highQuality;
+	generation.constants = constants;
+	generation.functions = std::move(functions);
+	generation.inputFunctions = std::move(inputFunctions);
+	generation.mGenerator = this;
+	generation.mRevision = mRevision;
+	generation.mResolution = std::move(resolution);
+	return generation;
 }
 
-void ProgramGenerator::RemoveDuplicates(std::vector<Function*>& functions)
+ProgramGenerator::UberProgramText ProgramGenerator::GenerateUberProgram(
+		const std::set<Variable>& inputs,
+		const std::set<Variable>& optionalInputs,
+		const std::set<Variable>& outputs,
+		const std::unordered_map<Variable, int>& inputArraySizes,
+		bool highQuality)
 {
-	std::unordered_set<Function*> seenFunctions;
-	for(auto it = functions.rbegin(); it != functions.rend(); ++it)
+	if(optionalInputs.size() > kMaxUberToggles)
+		throw std::invalid_argument("Too many optional inputs for an uber program");
+	if(!mSnippets->IsFrozen())
+		mSnippets->Freeze();
+
+	UberProgramText result;
+	std::vector<Variable> toggles(optionalInputs.begin(), optionalInputs.end());
+	for(auto toggle: toggles)
+	{
+		const SnippetVariable* info = mSnippets->FindVariable(toggle);
+		if(!info)
+			throw std::invalid_argument("Optional input \"" + ToString(toggle) + "\" used without declaration");
+		result.defines.push_back("HAS_" + *info->name);
+	}
+
+	// Resolve every combination of optional inputs separately:
+	const size_t combinationCount = size_t(1) << toggles.size();
+	uint64_t validMask = 0;
+	std::unique_ptr<UnsatisfiableOutputError> firstError;
+	UberDeclarations declarations;
+	std::unordered_map<Variable, int> arraySizes = inputArraySizes;
+	GSInfo geometryShaderInfo;
+	TessInfo tessellationInfo;
+	size_t geometryAffinity = 0;
+	std::vector<const Snippet*> functionsSeen; // In order of first appearance
+	std::unordered_map<const Snippet*, uint64_t> functionCombinations;
+	std::unordered_map<const Snippet*, std::set<const Snippet*>> dependencies;
+	for(size_t c = 0; c < combinationCount; c++)
 	{
-		if(!seenFunctions.insert(*it).second)
-			*it = nullptr;
+		const uint64_t combination = uint64_t(1) << c;
+		std::set<Variable> combinationInputs = inputs;
+		for(size_t i = 0; i < toggles.size(); i++)
+		{
+			if(c & (size_t(1) << i))
+				combinationInputs.insert(toggles[i]);
+		}
+
+		InputFunctionMap inputFunctions;
+		std::vector<const Snippet*> functions;
+		try
+		{
+			functions = ResolveOutputs(combinationInputs, Constants(), outputs, highQuality, inputFunctions);
+		}
+		catch(const UnsatisfiableOutputError& error)
+		{
+			if(!firstError)
+				firstError.reset(new UnsatisfiableOutputError(error));
+			continue;
+		}
+
+		std::unordered_map<Variable, int> combinationArraySizes = inputArraySizes;
+		ProgramEmitterInput emitterInput;
+		CollectEmitterInput(functions, inputFunctions, combinationInputs, *mSnippets, combinationArraySizes, emitterInput);
+		if(!validMask)
+		{
+			geometryShaderInfo = emitterInput.geometryShaderInfo;
+			tessellationInfo = emitterInput.tessellationInfo;
+			geometryAffinity = emitterInput.geometryCode.size();
+		}
+		else if(!(geometryShaderInfo == emitterInput.geometryShaderInfo) || geometryAffinity != emitterInput.geometryCode.size())
+			throw std::runtime_error("Optional inputs change the geometry shader configuration, cannot generate uber program");
+		else if(!(tessellationInfo == emitterInput.tessellationInfo))
+			throw std::runtime_error("Optional inputs change the tessellation configuration, cannot generate uber program");
+		validMask |= combination;
+		arraySizes.insert(combinationArraySizes.begin(), combinationArraySizes.end());
+
+		ProgramDeclarations combinationDeclarations = EmitGlslDeclarations(emitterInput, outputs, combinationArraySizes, *mSnippets, mEmitOptions);
+		for(size_t i = 0; i < kStageCount; i++)
+			AddAlternatives(declarations.stages[i], combinationDeclarations.stages[i], combination);
+
+		// Record functions, and which functions provide their inputs in this combination:
+		std::unordered_map<Variable, const Snippet*> producers;
+		for(const Snippet* func: functions)
+		{
+			if(functionCombinations.insert(std::make_pair(func, 0)).second)
+				functionsSeen.push_back(func);
+			functionCombinations[func] |= combination;
+			auto addDependency = [&](Variable input)
+			{
+				auto producer = producers.find(input);
+				if(producer != producers.end())
+					dependencies[func].insert(producer->second);
+			};
+			std::for_each(func->inputs.begin(), func->inputs.end(), addDependency);
+			std::for_each(func->calls.begin(), func->calls.end(), addDependency);
+			producers[func->output] = func;
+		}
+
+		std::vector<std::string> defines;
+		for(size_t i = 0; i < toggles.size(); i++)
+		{
+			if(c & (size_t(1) << i))
+				defines.push_back(result.defines[i]);
+		}
+		result.validCombinations.push_back(std::move(defines));
 	}
+
+	if(!validMask)
+		throw *firstError;
+
+	/* Order the functions of all combinations so that each comes after the functions it depends
+		on, otherwise keeping the order of first appearance: */
+	std::unordered_map<const Snippet*, size_t> firstAppearance;
+	for(size_t i = 0; i < functionsSeen.size(); i++)
+		firstAppearance[functionsSeen[i]] = i;
+	std::vector<const Snippet*> functions;
+	std::unordered_map<const Snippet*, bool> visited; // false while in progress
+	std::function<void(const Snippet*)> visit = [&](const Snippet* func)
+	{
+		auto state = visited.insert(std::make_pair(func, false));
+		if(!state.second)
+		{
+			if(!state.first->second)
+				throw std::runtime_error("Optional inputs require contradicting function order, cannot generate uber program");
+			return;
+		}
+
+		std::vector<const Snippet*> prerequisites(dependencies[func].begin(), dependencies[func].end());
+		std::sort(prerequisites.begin(), prerequisites.end(), [&](const Snippet* f1, const Snippet* f2){
+			return firstAppearance[f1] < firstAppearance[f2];
+		});
+		for(auto prerequisite: prerequisites)
+			visit(prerequisite);
+		visited[func] = true;
+		functions.push_back(func);
+	};
+	for(auto func: functionsSeen)
+		visit(func);
+
+	std::unordered_map<const Snippet*, std::string> conditions;
+	for(auto& it: functionCombinations)
+		conditions[it.first] = CombinationCondition(it.second, validMask, result.defines);
+
+	ProgramEmitterInput emitterInput;
+	CollectEmitterInput(functions, InputFunctionMap(), inputs, *mSnippets, arraySizes, emitterInput, &conditions);
+	emitterInput.geometryShaderInfo = geometryShaderInfo;
+	emitterInput.tessellationInfo = tessellationInfo;
+
+	ProgramDeclarations merged;
+	for(size_t i = 0; i < kStageCount; i++)
+		merged.stages[i] = MergeAlternatives(declarations.stages[i], validMask, result.defines);
+	result.text = AssembleGlslProgram(merged, emitterInput, mEmitOptions);
+	InternStages(result.text);
+	return result;
 }
 
-std::string ProgramGenerator::ToString(const std::set<Variable>& varSet)
+ProgramGenerator::ProgramGenerator() :
+	mSnippets(new SnippetLibrary)
 {
-	std::ostringstream oss;
-	oss << "{";
-	for(auto var: varSet)
+}
+
+ProgramGenerator::ProgramGenerator(std::shared_ptr<const SnippetLibrary> library) :
+	mSnippets(new SnippetLibrary(std::move(library)))
+{
+	if(mSnippets->GetBase() && !mSnippets->GetBase()->IsFrozen())
+		throw std::invalid_argument("Shared SnippetLibrary must be frozen");
+}
+
+ProgramGenerator::ProgramGenerator(ProgramGenerator&&) = default;
+ProgramGenerator& ProgramGenerator::operator=(ProgramGenerator&&) = default;
+ProgramGenerator::~ProgramGenerator() = default;
+
+void ProgramGenerator::AddFunction(const Function& function)
+{
+	AddFunction(Function(function));
+}
+
+void ProgramGenerator::AddFunction(Function&& function)
+{
+	if(mSnippets->AddFunction(std::move(function)))
 	{
-		auto it = mVariableInfos.find(var);
-		if(it == mVariableInfos.end())
-			oss << "<unknown>, ";
-		else
-			oss << it->second.name << ", ";
+		mUnsatisfiableRequests.clear();
+		mRevision++;
 	}
-	oss << "}";
+}
+
+void ProgramGenerator::AddProgramFile(ProgramFile&& file)
+{
+	mSnippets->AddProgramFile(std::move(file));
+	mUnsatisfiableRequests.clear();
+	mRevision++;
+}
+
+void ProgramGenerator::AddProgramFile(const ProgramFile& file)
+{
+	mSnippets->AddProgramFile(file);
+	mUnsatisfiableRequests.clear();
+	mRevision++;
+}
+
+void ProgramGenerator::AddEmbeddedSnippets(const EmbeddedSnippets& snippets)
+{
+	mSnippets->AddEmbeddedSnippets(snippets);
+	mUnsatisfiableRequests.clear();
+	mRevision++;
+}
+
+void ProgramGenerator::ReserveVariables(size_t count)
+{
+	mSnippets->ReserveVariables(count);
+}
+
+ProgramGenerator::Variable ProgramGenerator::AddVariable(const char* name, const char* type, bool array, VariableInfo::Usage usage)
+{
+	return AddVariable(VariableInfo(name, type, array, usage));
+}
+
+ProgramGenerator::Variable ProgramGenerator::AddVariable(const VariableInfo& variable)
+{
+	return AddVariable(VariableInfo(variable));
+}
+
+ProgramGenerator::Variable ProgramGenerator::AddVariable(VariableInfo&& variable)
+{
+	mRevision++;
+	return mSnippets->AddVariable(std::move(variable));
+}
+
+void ProgramGenerator::InternStages(ProgramText& text)
+{
+	for(size_t i = 0; i < kStageCount; i++)
+	{
+		const std::string& stage = text.*kStageTexts[i];
+		const uint64_t hash = HashStageText(stage);
+		text.*kStageHashes[i] = hash;
+		if(!hash || mStages.count(hash))
+			continue;
+		if(mStages.size() >= kMaxStages)
+			mStages.clear();
+		mStages.insert(std::make_pair(hash, std::make_shared<const std::string>(stage)));
+	}
+}
+
+std::shared_ptr<const std::string> ProgramGenerator::FindStage(uint64_t hash) const
+{
+	auto it = mStages.find(hash);
+	return it != mStages.end() ? it->second : nullptr;
+}
+
+bool ProgramGenerator::IsOutput(Variable variable) const
+{
+	const SnippetVariable* info = mSnippets->FindVariable(variable);
+	return info && info->usage == VariableInfo::Usage::kOutput;
+}
+
+/// Counts the steps of all searches for one program against a SearchBudget
+class SearchLimit
+{
+public:
+	explicit SearchLimit(const ProgramGenerator::SearchBudget& budget) :
+		mBudget(budget), mStart(std::chrono::steady_clock::now())
+	{}
+
+	/// Count one step
+	/** Thread safe. @return false if the budget is used up. */
+	bool Step()
+	{
+		if(mExceeded.load(std::memory_order_relaxed))
+			return false;
+		const uint64_t steps = mSteps.fetch_add(1, std::memory_order_relaxed) + 1;
+		// Reading the clock costs more than a step
+		if((mBudget.maxSteps && steps > mBudget.maxSteps)
+				|| (mBudget.timeout.count() && (steps & 0xff) == 0 && Elapsed() > mBudget.timeout))
+		{
+			mExceeded.store(true, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	bool Exceeded() const {return mExceeded.load(std::memory_order_relaxed);}
+
+	ProgramGenerator::SearchStats GetStats() const
+	{
+		ProgramGenerator::SearchStats stats;
+		stats.steps = mSteps.load(std::memory_order_relaxed);
+		if(mBudget.maxSteps)
+			stats.steps = std::min(stats.steps, mBudget.maxSteps);
+		stats.duration = Elapsed();
+		stats.budgetExceeded = Exceeded();
+		return stats;
+	}
+
+private:
+	std::chrono::microseconds Elapsed() const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mStart);
+	}
+
+	const ProgramGenerator::SearchBudget mBudget;
+	const std::chrono::steady_clock::time_point mStart;
+	std::atomic<uint64_t> mSteps {0};
+	std::atomic<bool> mExceeded {false};
+};
+
+/// Joint search for the functions providing all outputs of a program
+/** Each variable is bound to one producing function, which all consumers share. Pure functions
+	are bound per variable and stage, since they are emitted into each stage using them. The
+	search backtracks over candidates in CompareFunctions order. Variables that cannot be
+	derived from the inputs at all are determined up front, so candidates depending on them
+	are never tried. A search can be seeded with a previous one, keeping its choices for
+	variables that do not depend on changed inputs.
+
+	With a SearchPool, independent outputs and alternative candidates are searched on
+	branches. A branch shares the caches of the search, and only records the bindings it
+	adds on top of the resolver it was forked from. */
+class ProgramGenerator::Resolver
+{
+public:
+	Resolver(const ProgramGenerator& generator, const std::set<Variable>& inputs, const Constants& constants, bool highQuality, SearchLimit& limit) :
+		mGenerator(generator), mInputs(inputs), mConstants(constants), mHighQuality(highQuality), mLimit(limit),
+		mShared(std::make_shared<Shared>())
+	{}
+
+	/// Search on the threads of pool
+	/** Call before Resolve(). pool must outlive the resolver. */
+	void SetPool(SearchPool& pool) {mShared->pool = &pool;}
+
+	/// Reuse a previous search of a request that differs in changedInputs
+	/** Call before Resolve(). previous must outlive the resolver. */
+	void Seed(const Resolution& previous, const std::set<Variable>& changedInputs);
+
+	/// Bind producers for all outputs
+	/** @return false if there is no consistent binding, or if the SearchLimit is exceeded. */
+	bool Resolve(const std::set<Variable>& outputs);
+
+	/// Store the state of a successful search
+	void Export(Resolution& resolution) const;
+
+	/// Bound functions, ordered with dependencies first
+	std::vector<const Snippet*> GetFunctions(const std::set<Variable>& outputs) const;
+
+	/// Map inputs of bound functions to the bound functions providing them
+	void GetInputFunctions(InputFunctionMap& inputFunctions) const;
+
+	/// Chain of variables from an output down to the first one that cannot be provided
+	/** Empty if all outputs can be derived on their own, but no consistent binding exists. */
+	const std::vector<Variable>& GetMissingChain() const {return mMissingChain;}
+
+private:
+	/// Pipeline configuration implied by the functions bound so far
+	struct PipelineState
+	{
+		/// Number of geometry shader bodies, 0 if the geometry stage is not used
+		size_t gsAffinity = 0;
+		/// True if a tessellation stage is used
+		bool tessellation = false;
+
+		bool operator==(const PipelineState& other) const
+		{
+			return gsAffinity == other.gsAffinity && tessellation == other.tessellation;
+		}
+	};
+
+	/// Variable that still needs a producer
+	struct Goal
+	{
+		Variable variable;
+		/// Function consuming the variable, nullptr for outputs
+		const SnippetRecord* consumer;
+	};
+
+	/// Alternative of a parallel choice
+	struct Branch
+	{
+		/// Index of the best successful alternative so far
+		const std::atomic<size_t>* winner;
+		size_t index;
+	};
+
+	/// Fork a branch that continues the search of parent
+	/** parent must not change while the branch exists. */
+	Resolver(const Resolver& parent, Branch branch);
+
+	/// Variable and stage of a binding, the stage is only used for pure functions
+	typedef std::pair<Variable, int> BindingKey;
+	typedef std::map<BindingKey, const SnippetRecord*> BindingMap;
+
+	static BindingKey Key(Variable variable, const SnippetRecord* function)
+	{
+		return BindingKey(variable, function->pureFunction ? static_cast<int>(function->stage) : -1);
+	}
+
+	const std::vector<const SnippetRecord*>& Candidates(Variable variable);
+	/// Compute the derivable variables among everything reachable from the outputs
+	void FindDerivable(const std::set<Variable>& outputs);
+	bool IsDerivable(Variable variable) const {return mInputs.count(variable) || mShared->derivable.count(variable);}
+	std::vector<Variable> FindMissingChain(Variable output);
+
+	/// Function bound for a variable as seen by a consumer
+	static const SnippetRecord* FindBinding(const BindingMap& bindings, Variable variable, const SnippetRecord* consumer);
+	/// Function bound for a variable as seen by a consumer, on this branch or the ones it was forked from
+	const SnippetRecord* FindBinding(Variable variable, const SnippetRecord* consumer) const;
+	/// Checks if function depends on dependency through bound variables
+	bool DependsOn(const SnippetRecord* function, const SnippetRecord* dependency) const;
+	/// Checks if all bindings made so far fit the current pipeline
+	bool StagesValid() const;
+
+	/// Split outputs into groups that share no variables, in order
+	/** Returns a single group if any output may need a geometry or tessellation function,
+		since those change the stage rules for all other functions. */
+	std::vector<std::vector<Variable>> IndependentOutputs(const std::set<Variable>& outputs);
+	/// Solve each group of outputs on its own branch in parallel, adopting all of them
+	bool SolveIndependent(const std::vector<std::vector<Variable>>& groups);
+	/// Process goals, binding producers where needed
+	bool Solve(std::vector<Goal> goals);
+	/// Try all candidates for a goal, then process the remaining goals
+	/** The previous choice for a kept variable is tried first. */
+	bool Choose(const Goal& goal, const std::vector<Goal>& goals);
+	/// Bind a candidate for a goal, then process the remaining goals
+	bool TryCandidate(const SnippetRecord* candidate, const Goal& goal, const std::vector<Goal>& goals);
+	/// Try candidates on branches in parallel, adopting the best successful one
+	/** Gives the same result as trying them in order, because all choices since the
+		last fork had a single candidate, so a failure here fails the whole branch. */
+	bool ChooseParallel(const std::vector<const SnippetRecord*>& candidates, const Goal& goal, const std::vector<Goal>& goals);
+	/// Checks if a better alternative of any enclosing parallel choice succeeded
+	bool Cancelled() const;
+	/// Take over the bindings of a successful branch forked from this resolver
+	void Adopt(const Resolver& branch);
+
+	const ProgramGenerator& mGenerator;
+	const std::set<Variable>& mInputs;
+	const Constants& mConstants;
+	const bool mHighQuality;
+	SearchLimit& mLimit;
+
+	/// State of the search shared by all branches
+	/** Only the caches change once the goals are being solved. */
+	struct Shared
+	{
+		std::unordered_map<Variable, std::vector<const SnippetRecord*>> candidates;
+		/// Inputs of all candidates of each variable in candidates
+		std::unordered_map<Variable, std::vector<Variable>> dependencies;
+		/// Guards candidates and dependencies while searching on a pool
+		std::mutex mutex;
+		std::unordered_set<Variable> derivable;
+		/// Seed of the search, may be nullptr
+		const Resolution* previous = nullptr;
+		/// Variables of previous not depending on changed inputs
+		std::unordered_set<Variable> kept;
+		/// Threads for parallel searches, nullptr for a sequential search
+		SearchPool* pool = nullptr;
+	};
+	std::shared_ptr<Shared> mShared;
+
+	/// Resolver this branch was forked from, nullptr for the root of the search
+	const Resolver* mParent = nullptr;
+	/// Bindings made since the fork
+	BindingMap mBindings;
+	/// Consumer and producer of each variable bound since the fork, for checking stage rules
+	std::vector<std::pair<const SnippetRecord*, const SnippetRecord*>> mEdges;
+	PipelineState mPipeline;
+	std::vector<Variable> mMissingChain;
+	/// Parallel choices this resolver is an alternative of, outermost first
+	std::vector<Branch> mBranches;
+};
+
+ProgramGenerator::Resolver::Resolver(const Resolver& parent, Branch branch) :
+	mGenerator(parent.mGenerator), mInputs(parent.mInputs), mConstants(parent.mConstants),
+	mHighQuality(parent.mHighQuality), mLimit(parent.mLimit),
+	mShared(parent.mShared), mParent(&parent), mPipeline(parent.mPipeline), mBranches(parent.mBranches)
+{
+	mBranches.push_back(branch);
+}
+
+const std::vector<const ProgramGenerator::SnippetRecord*>& ProgramGenerator::Resolver::Candidates(Variable variable)
+{
+	Shared& shared = *mShared;
+	std::unique_lock<std::mutex> lock;
+	if(shared.pool)
+		lock = std::unique_lock<std::mutex>(shared.mutex);
+	// Elements of unordered_map stay in place, so the result remains valid after unlocking
+	auto it = shared.candidates.find(variable);
+	if(it == shared.candidates.end())
+	{
+		it = shared.candidates.insert(std::make_pair(variable, mGenerator.FindCandidateFunctions(variable, mConstants, mHighQuality))).first;
+		std::vector<Variable>& dependencies = shared.dependencies[variable];
+		for(auto candidate: it->second)
+			dependencies.insert(dependencies.end(), candidate->inputs, candidate->InputsEnd());
+		std::sort(dependencies.begin(), dependencies.end());
+		dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+	}
+	return it->second;
+}
+
+void ProgramGenerator::Resolver::Seed(const Resolution& previous, const std::set<Variable>& changedInputs)
+{
+	// A variable is affected if a changed input is reachable through any of its candidates:
+	std::unordered_map<Variable, std::vector<Variable>> users;
+	for(auto& it: previous.dependencies)
+	{
+		for(auto input: it.second)
+			users[input].push_back(it.first);
+	}
+	std::unordered_set<Variable> affected;
+	std::vector<Variable> queue(changedInputs.begin(), changedInputs.end());
+	while(!queue.empty())
+	{
+		Variable variable = queue.back();
+		queue.pop_back();
+		if(!affected.insert(variable).second)
+			continue;
+		auto it = users.find(variable);
+		if(it != users.end())
+			queue.insert(queue.end(), it->second.begin(), it->second.end());
+	}
+
+	mShared->previous = &previous;
+	for(auto& it: previous.dependencies)
+	{
+		if(affected.count(it.first))
+			continue;
+		mShared->kept.insert(it.first);
+		if(previous.derivable.count(it.first))
+			mShared->derivable.insert(it.first);
+	}
+}
+
+void ProgramGenerator::Resolver::Export(Resolution& resolution) const
+{
+	const Shared& shared = *mShared;
+	resolution.dependencies = shared.dependencies;
+	if(shared.previous)
+	{
+		for(auto variable: shared.kept)
+			resolution.dependencies.insert(*shared.previous->dependencies.find(variable));
+	}
+	resolution.derivable = shared.derivable;
+	resolution.bindings = mBindings;
+}
+
+void ProgramGenerator::Resolver::FindDerivable(const std::set<Variable>& outputs)
+{
+	// Collect variables that may be needed:
+	std::vector<Variable> reachable;
+	std::unordered_set<Variable> seen;
+	std::vector<Variable> queue(outputs.begin(), outputs.end());
+	while(!queue.empty())
+	{
+		Variable variable = queue.back();
+		queue.pop_back();
+		// Derivability of kept variables is known already
+		if(mInputs.count(variable) || mShared->kept.count(variable) || !seen.insert(variable).second)
+			continue;
+		reachable.push_back(variable);
+		for(auto candidate: Candidates(variable))
+			queue.insert(queue.end(), candidate->inputs, candidate->InputsEnd());
+	}
+
+	// Least fixpoint: a variable is derivable if one of its candidates has only derivable inputs
+	bool changed = true;
+	while(changed)
+	{
+		changed = false;
+		for(auto variable: reachable)
+		{
+			if(mShared->derivable.count(variable))
+				continue;
+			for(auto candidate: Candidates(variable))
+			{
+				if(std::all_of(candidate->inputs, candidate->InputsEnd(), [this](Variable input){return IsDerivable(input);}))
+				{
+					mShared->derivable.insert(variable);
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+}
+
+std::vector<ProgramGenerator::Variable> ProgramGenerator::Resolver::FindMissingChain(Variable output)
+{
+	// Follow the first underivable input of the best candidate down to a variable without candidates
+	std::vector<Variable> chain = {output};
+	std::unordered_set<Variable> visited = {output};
+	while(!Candidates(chain.back()).empty())
+	{
+		const SnippetRecord* candidate = Candidates(chain.back()).front();
+		auto input = std::find_if(candidate->inputs, candidate->InputsEnd(), [this](Variable input){return !IsDerivable(input);});
+		if(input == candidate->InputsEnd() || !visited.insert(*input).second)
+			break;
+		chain.push_back(*input);
+	}
+	return chain;
+}
+
+const ProgramGenerator::SnippetRecord* ProgramGenerator::Resolver::FindBinding(const BindingMap& bindings, Variable variable, const SnippetRecord* consumer)
+{
+	if(consumer)
+	{
+		auto pure = bindings.find(BindingKey(variable, static_cast<int>(consumer->stage)));
+		if(pure != bindings.end())
+			return pure->second;
+	}
+	auto it = bindings.find(BindingKey(variable, -1));
+	return it != bindings.end() ? it->second : nullptr;
+}
+
+const ProgramGenerator::SnippetRecord* ProgramGenerator::Resolver::FindBinding(Variable variable, const SnippetRecord* consumer) const
+{
+	// Same precedence as on a single map, bindings of a branch and its parents never overlap
+	if(consumer)
+	{
+		const BindingKey pure(variable, static_cast<int>(consumer->stage));
+		for(const Resolver* resolver = this; resolver; resolver = resolver->mParent)
+		{
+			auto it = resolver->mBindings.find(pure);
+			if(it != resolver->mBindings.end())
+				return it->second;
+		}
+	}
+	const BindingKey key(variable, -1);
+	for(const Resolver* resolver = this; resolver; resolver = resolver->mParent)
+	{
+		auto it = resolver->mBindings.find(key);
+		if(it != resolver->mBindings.end())
+			return it->second;
+	}
+	return nullptr;
+}
+
+bool ProgramGenerator::Resolver::DependsOn(const SnippetRecord* function, const SnippetRecord* dependency) const
+{
+	std::vector<const SnippetRecord*> stack = {function};
+	std::unordered_set<const SnippetRecord*> visited;
+	while(!stack.empty())
+	{
+		const SnippetRecord* current = stack.back();
+		stack.pop_back();
+		if(current == dependency)
+			return true;
+		if(!visited.insert(current).second)
+			continue;
+		for(const Variable* input = current->inputs; input != current->InputsEnd(); ++input)
+		{
+			if(const SnippetRecord* producer = FindBinding(*input, current))
+				stack.push_back(producer);
+		}
+	}
+	return false;
+}
+
+bool ProgramGenerator::Resolver::StagesValid() const
+{
+	for(const Resolver* resolver = this; resolver; resolver = resolver->mParent)
+	{
+		for(auto& edge: resolver->mEdges)
+		{
+			if(InvalidStageDependence(edge.first->stage, edge.second->stage, mPipeline.gsAffinity != 0, mPipeline.tessellation))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool ProgramGenerator::Resolver::Resolve(const std::set<Variable>& outputs)
+{
+	FindDerivable(outputs);
+	for(auto output: outputs)
+	{
+		if(!IsDerivable(output))
+		{
+			mMissingChain = FindMissingChain(output);
+			return false;
+		}
+	}
+
+	if(mShared->pool && outputs.size() > 1)
+	{
+		std::vector<std::vector<Variable>> groups = IndependentOutputs(outputs);
+		if(groups.size() > 1)
+			return SolveIndependent(groups);
+	}
+
+	// Goals are processed from the back:
+	std::vector<Goal> goals;
+	for(auto it = outputs.rbegin(); it != outputs.rend(); ++it)
+		goals.push_back(Goal{*it, nullptr});
+	return Solve(std::move(goals));
+}
+
+std::vector<std::vector<ProgramGenerator::Variable>> ProgramGenerator::Resolver::IndependentOutputs(const std::set<Variable>& outputs)
+{
+	const std::vector<Variable> ordered(outputs.begin(), outputs.end());
+	std::vector<size_t> groupOf(ordered.size());
+	for(size_t i = 0; i < groupOf.size(); i++)
+		groupOf[i] = i;
+	auto root = [&](size_t index)
+	{
+		while(groupOf[index] != index)
+			index = groupOf[index] = groupOf[groupOf[index]];
+		return index;
+	};
+
+	// Walk the variables reachable through any candidate that may be tried, merging outputs
+	// that reach the same one. Underivable variables are never bound, so they can be shared.
+	std::unordered_map<Variable, size_t> reachedBy;
+	for(size_t i = 0; i < ordered.size(); i++)
+	{
+		std::vector<Variable> queue = {ordered[i]};
+		while(!queue.empty())
+		{
+			Variable variable = queue.back();
+			queue.pop_back();
+			if(mInputs.count(variable) || !IsDerivable(variable))
+				continue;
+			auto reached = reachedBy.insert(std::make_pair(variable, i));
+			if(!reached.second)
+			{
+				// Everything reachable from here belongs to that output already
+				groupOf[root(i)] = root(reached.first->second);
+				continue;
+			}
+			for(auto candidate: Candidates(variable))
+			{
+				if(!std::all_of(candidate->inputs, candidate->InputsEnd(), [this](Variable input){return IsDerivable(input);}))
+					continue;
+				if(!candidate->pureFunction && (candidate->stage == Function::Stage::kGeometryStage
+						|| candidate->stage == Function::Stage::kTessControlStage
+						|| candidate->stage == Function::Stage::kTessEvaluationStage))
+					return std::vector<std::vector<Variable>>(1, ordered);
+				queue.insert(queue.end(), candidate->inputs, candidate->InputsEnd());
+			}
+		}
+	}
+
+	std::vector<std::vector<Variable>> groups;
+	std::vector<size_t> groupIndex(ordered.size(), ordered.size());
+	for(size_t i = 0; i < ordered.size(); i++)
+	{
+		size_t& index = groupIndex[root(i)];
+		if(index == ordered.size())
+		{
+			index = groups.size();
+			groups.emplace_back();
+		}
+		groups[index].push_back(ordered[i]);
+	}
+	return groups;
+}
+
+bool ProgramGenerator::Resolver::SolveIndependent(const std::vector<std::vector<Variable>>& groups)
+{
+	// Each group is needed, so a failing one cancels the others:
+	std::atomic<size_t> status(1);
+	std::vector<std::unique_ptr<Resolver>> branches;
+	for(size_t i = 0; i < groups.size(); i++)
+		branches.emplace_back(new Resolver(*this, Branch{&status, 1}));
+
+	auto solve = [&](size_t index)
+	{
+		std::vector<Goal> goals;
+		for(auto it = groups[index].rbegin(); it != groups[index].rend(); ++it)
+			goals.push_back(Goal{*it, nullptr});
+		try
+		{
+			if(!branches[index]->Solve(std::move(goals)))
+				status.store(0);
+		}
+		catch(...)
+		{
+			status.store(0);
+			throw;
+		}
+	};
+
+	SearchPool::TaskGroup tasks(*mShared->pool);
+	for(size_t i = 1; i < groups.size(); i++)
+		tasks.Submit([&solve, i](){solve(i);});
+	tasks.Run([&solve](){solve(0);});
+	tasks.Wait();
+
+	if(status.load() == 0)
+		return false;
+	for(auto& branch: branches)
+		Adopt(*branch);
+	return true;
+}
+
+bool ProgramGenerator::Resolver::Solve(std::vector<Goal> goals)
+{
+	while(!goals.empty())
+	{
+		Goal goal = goals.back();
+		goals.pop_back();
+		if(mInputs.count(goal.variable))
+			continue;
+
+		const SnippetRecord* bound = FindBinding(goal.variable, goal.consumer);
+		if(!bound)
+			return Choose(goal, goals);
+
+		// Reuse the producer that is already bound:
+		if(!goal.consumer)
+			continue;
+		if(DependsOn(bound, goal.consumer)
+				|| (bound->pureFunction && bound->stage != goal.consumer->stage)
+				|| InvalidStageDependence(goal.consumer->stage, bound->stage, mPipeline.gsAffinity != 0, mPipeline.tessellation))
+			return false;
+		mEdges.push_back(std::make_pair(goal.consumer, bound));
+	}
+	return true;
+}
+
+bool ProgramGenerator::Resolver::Choose(const Goal& goal, const std::vector<Goal>& goals)
+{
+	const Shared& shared = *mShared;
+	const SnippetRecord* seed = nullptr;
+	if(shared.previous && shared.kept.count(goal.variable))
+		seed = FindBinding(shared.previous->bindings, goal.variable, goal.consumer);
+
+	const std::vector<const SnippetRecord*>& candidates = Candidates(goal.variable);
+	if(shared.pool && candidates.size() > 1 && shared.pool->HasIdleWorkers())
+	{
+		std::vector<const SnippetRecord*> ordered;
+		if(seed)
+			ordered.push_back(seed);
+		for(auto candidate: candidates)
+		{
+			if(candidate != seed)
+				ordered.push_back(candidate);
+		}
+		return ChooseParallel(ordered, goal, goals);
+	}
+
+	if(seed && TryCandidate(seed, goal, goals))
+		return true;
+	for(auto candidate: candidates)
+	{
+		if(candidate != seed && TryCandidate(candidate, goal, goals))
+			return true;
+	}
+	return false;
+}
+
+bool ProgramGenerator::Resolver::ChooseParallel(const std::vector<const SnippetRecord*>& candidates, const Goal& goal, const std::vector<Goal>& goals)
+{
+	const size_t count = candidates.size();
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> winner(count);
+	std::vector<std::unique_ptr<Resolver>> results(count);
+
+	// Each task takes the next untried candidate, in order:
+	auto work = [&]()
+	{
+		try
+		{
+			for(size_t index = next++; index < count; index = next++)
+			{
+				if(winner.load() < index || Cancelled())
+					continue;
+				std::unique_ptr<Resolver> branch(new Resolver(*this, Branch{&winner, index}));
+				if(branch->TryCandidate(candidates[index], goal, goals))
+				{
+					results[index] = std::move(branch);
+					size_t best = winner.load();
+					while(index < best && !winner.compare_exchange_weak(best, index))
+						;
+				}
+			}
+		}
+		catch(...)
+		{
+			winner.store(0); // Cancel all branches
+			throw;
+		}
+	};
+
+	SearchPool& pool = *mShared->pool;
+	SearchPool::TaskGroup tasks(pool);
+	const size_t helpers = std::min<size_t>(count - 1, pool.GetWorkerCount());
+	for(size_t i = 0; i < helpers; i++)
+		tasks.Submit(work);
+	tasks.Run(work);
+	tasks.Wait();
+
+	const size_t best = winner.load();
+	if(best == count)
+		return false;
+	Adopt(*results[best]);
+	return true;
+}
+
+bool ProgramGenerator::Resolver::Cancelled() const
+{
+	for(auto& branch: mBranches)
+	{
+		if(branch.winner->load(std::memory_order_relaxed) < branch.index)
+			return true;
+	}
+	return false;
+}
+
+void ProgramGenerator::Resolver::Adopt(const Resolver& branch)
+{
+	for(auto& binding: branch.mBindings)
+		mBindings[binding.first] = binding.second;
+	mEdges.insert(mEdges.end(), branch.mEdges.begin(), branch.mEdges.end());
+	mPipeline = branch.mPipeline;
+}
+
+bool ProgramGenerator::Resolver::TryCandidate(const SnippetRecord* candidate, const Goal& goal, const std::vector<Goal>& goals)
+{
+	if(!mLimit.Step() || (!mBranches.empty() && Cancelled()))
+		return false;
+	if(!std::all_of(candidate->inputs, candidate->InputsEnd(), [this](Variable input){return IsDerivable(input);}))
+		return false;
+
+	if(goal.consumer)
+	{
+		//check dependency on pure function within different pipline stage
+		if(candidate->pureFunction && candidate->stage != goal.consumer->stage)
+			return false;
+		//check backward pipline dependency, and dependency across an enabled geometry or tessellation stage
+		if(InvalidStageDependence(goal.consumer->stage, candidate->stage, mPipeline.gsAffinity != 0, mPipeline.tessellation))
+			return false;
+	}
+
+	// Check GS affinity if not pure function
+	const PipelineState previousPipeline = mPipeline;
+	if(!candidate->pureFunction)
+	{
+		if(candidate->stage == Function::Stage::kGeometryStage)
+		{
+			if(mPipeline.gsAffinity != 0 && candidate->sourceCount != mPipeline.gsAffinity)
+				//This function is not aligned with general geometry shader affinity (number of vertex outputs)
+				return false;
+			//in case if it is first geometry stage function, make affinity fit number of sources
+			mPipeline.gsAffinity = candidate->sourceCount;
+		}
+		// Any tessellation stage function enables both tessellation stages
+		else if(candidate->stage == Function::Stage::kTessControlStage ||
+				candidate->stage == Function::Stage::kTessEvaluationStage)
+			mPipeline.tessellation = true;
+	}
+
+	// Enabling a stage may break variables already passed across it
+	if(!(mPipeline == previousPipeline) && !StagesValid())
+	{
+		mPipeline = previousPipeline;
+		return false;
+	}
+
+	const BindingKey key = Key(goal.variable, candidate);
+	const size_t edgeCount = mEdges.size();
+	mBindings[key] = candidate;
+	if(goal.consumer)
+		mEdges.push_back(std::make_pair(goal.consumer, candidate));
+
+	std::vector<Goal> next = goals;
+	for(const Variable* input = candidate->InputsEnd(); input != candidate->inputs; )
+		next.push_back(Goal{*--input, candidate});
+	if(Solve(std::move(next)))
+		return true;
+
+	// Backtrack:
+	mBindings.erase(key);
+	mEdges.resize(edgeCount);
+	mPipeline = previousPipeline;
+	return false;
+}
+
+std::vector<const ProgramGenerator::Snippet*> ProgramGenerator::Resolver::GetFunctions(const std::set<Variable>& outputs) const
+{
+	// Post-order traversal, so that each function comes after the functions it uses
+	std::vector<const Snippet*> functions;
+	std::unordered_set<const SnippetRecord*> visited;
+	std::function<void(const SnippetRecord*)> visit = [&](const SnippetRecord* function)
+	{
+		if(!visited.insert(function).second)
+			return;
+		for(const Variable* input = function->InputsEnd(); input != function->inputs; )
+		{
+			if(const SnippetRecord* producer = FindBinding(*--input, function))
+				visit(producer);
+		}
+		functions.push_back(function->snippet);
+	};
+	for(auto it = outputs.rbegin(); it != outputs.rend(); ++it)
+	{
+		if(const SnippetRecord* producer = FindBinding(*it, nullptr))
+			visit(producer);
+	}
+	return functions;
+}
+
+void ProgramGenerator::Resolver::GetInputFunctions(InputFunctionMap& inputFunctions) const
+{
+	for(auto& binding: mBindings)
+	{
+		const SnippetRecord* function = binding.second;
+		for(const Variable* input = function->inputs; input != function->InputsEnd(); ++input)
+		{
+			if(mInputs.count(*input))
+				continue;
+			if(const SnippetRecord* producer = FindBinding(*input, function))
+				inputFunctions[function->snippet][*input] = producer->snippet;
+		}
+	}
+}
+
+std::vector<const ProgramGenerator::Snippet*> ProgramGenerator::ResolveOutputs(const std::set<Variable>& inputs, const Constants& constants, const std::set<Variable>& outputs, bool highQuality, InputFunctionMap& inputFunctions)
+{
+	return ResolveOutputs(inputs, constants, outputs, highQuality, inputFunctions, nullptr, nullptr, std::set<Variable>());
+}
+
+std::vector<const ProgramGenerator::Snippet*> ProgramGenerator::ResolveOutputs(const std::set<Variable>& inputs, const Constants& constants, const std::set<Variable>& outputs, bool highQuality, InputFunctionMap& inputFunctions, Resolution* resolution, const Resolution* previous, const std::set<Variable>& changedInputs)
+{
+	SearchLimit limit(mSearchBudget);
+	const unsigned threads = mSearchThreads ? mSearchThreads : std::max(std::thread::hardware_concurrency(), 1u);
+	if(threads < 2)
+		mSearchPool.reset();
+	else if(!mSearchPool || mSearchPool->GetWorkerCount() != threads - 1)
+		mSearchPool.reset(new SearchPool(threads - 1));
+	auto checkLimit = [&]()
+	{
+		mLastSearchStats = limit.GetStats();
+		if(!limit.Exceeded())
+			return;
+		if(Reports(Diagnostic::Level::kWarning))
+			Report(Diagnostic::Level::kWarning, Diagnostic::Event::kSearchBudgetExceeded);
+		std::ostringstream oss;
+		oss << "Search budget exceeded after " << mLastSearchStats.steps << " steps and "
+				<< mLastSearchStats.duration.count() << " us, outputs " << ToString(outputs);
+		throw SearchBudgetExceededError(oss.str(), mLastSearchStats);
+	};
+
+	if(previous)
+	{
+		Resolver resolver(*this, inputs, constants, highQuality, limit);
+		if(mSearchPool)
+			resolver.SetPool(*mSearchPool);
+		resolver.Seed(*previous, changedInputs);
+		if(resolver.Resolve(outputs))
+		{
+			auto functions = resolver.GetFunctions(outputs);
+			resolver.GetInputFunctions(inputFunctions);
+			if(resolution)
+				resolver.Export(*resolution);
+			mLastSearchStats = limit.GetStats();
+			return functions;
+		}
+		checkLimit();
+		// Kept choices conflict with the new ones, search from scratch
+	}
+
+	size_t key = highQuality;
+	for(auto it: inputs)
+		key = HashCombine(key, it);
+	// Constants are not ordered, so their hashes are combined by an order independent sum
+	size_t constantsKey = 0;
+	for(auto& it: constants)
+		constantsKey += HashCombine(~it.first, std::hash<std::string>()(it.second));
+	key = HashCombine(key, constantsKey);
+	for(auto it: outputs)
+		key = HashCombine(key, it ^ 0x5bd1e995);
+
+	const UnsatisfiableRequest* failed = nullptr;
+	auto range = mUnsatisfiableRequests.equal_range(key);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		const UnsatisfiableRequest& request = it->second;
+		if(request.highQuality == highQuality && request.outputs == outputs
+				&& request.inputs == inputs && request.constants == constants)
+		{
+			failed = &request;
+			break;
+		}
+	}
+
+	if(!failed)
+	{
+		Resolver resolver(*this, inputs, constants, highQuality, limit);
+		if(mSearchPool)
+			resolver.SetPool(*mSearchPool);
+		if(resolver.Resolve(outputs))
+		{
+			auto functions = resolver.GetFunctions(outputs);
+			resolver.GetInputFunctions(inputFunctions);
+			if(resolution)
+				resolver.Export(*resolution);
+			mLastSearchStats = limit.GetStats();
+			return functions;
+		}
+		checkLimit();
+
+		// Find an output to blame:
+		std::vector<Variable> missingChain = resolver.GetMissingChain();
+		for(auto it = outputs.begin(); missingChain.empty() && it != outputs.end(); ++it)
+		{
+			Resolver single(*this, inputs, constants, highQuality, limit);
+			if(!single.Resolve({*it}))
+			{
+				checkLimit();
+				missingChain = single.GetMissingChain();
+				if(missingChain.empty())
+					missingChain = {*it};
+			}
+		}
+		if(missingChain.empty())
+			missingChain = {*outputs.begin()}; // Outputs only conflict with each other
+
+		if(mUnsatisfiableRequests.size() >= kMaxUnsatisfiableRequests)
+			mUnsatisfiableRequests.clear();
+		auto it = mUnsatisfiableRequests.insert(std::make_pair(key, UnsatisfiableRequest{inputs, constants, outputs, highQuality, std::move(missingChain)}));
+		failed = &it->second;
+	}
+
+	mLastSearchStats = limit.GetStats();
+	Variable output = failed->missingChain.front();
+	if(Reports(Diagnostic::Level::kInfo))
+		Report(Diagnostic::Level::kInfo, Diagnostic::Event::kUnsatisfiableOutput, output);
+
+	std::ostringstream oss;
+	oss << "Cannot derive \"" << ToString(output) << "\" from inputs " << ToString(inputs) << ": ";
+	for(size_t i = 0; i < failed->missingChain.size(); i++)
+		oss << (i ? " <- " : "") << ToString(failed->missingChain[i]);
+	if(failed->missingChain.size() > 1 || !mSnippets->ProvidesOutput(output))
+		oss << " (not provided)";
+	else
+		oss << " (no valid execution path)";
+	throw UnsatisfiableOutputError(oss.str(), output, failed->missingChain);
+}
+
+std::string ProgramGenerator::ToString(const std::set<Variable>& varSet) const
+{
+	std::ostringstream oss;
+	oss << "{";
+	for(auto var: varSet)
+	{
+		const SnippetVariable* info = mSnippets->FindVariable(var);
+		if(!info)
+			oss << "<unknown>, ";
+		else
+			oss << *info->name << ", ";
+	}
+	oss << "}";
+	return oss.str();
+}
+
+std::string ProgramGenerator::ToString(Variable variable) const
+{
+	const SnippetVariable* info = mSnippets->FindVariable(variable);
+	if(info)
+		return *info->name;
+
+	std::ostringstream oss;
+	oss << "<unknown 0x" << std::hex << variable << ">";
 	return oss.str();
 }
 
-bool ProgramGenerator::CompareFunctions::operator() (Function* f1, Function* f2)
+bool ProgramGenerator::CompareFunctions::operator() (const SnippetRecord* f1, const SnippetRecord* f2)
 {
 	if(f1->highQuality == f2->highQuality)
 	{
-		if(f1->priority == f2->priority)
-			return (f1->inputs.size() > f2->inputs.size());
+		// Candidates are filtered before, so specializations always apply
+		if(f1->specializationCount != f2->specializationCount)
+			return (f1->specializationCount > f2->specializationCount);
+		else if(f1->priority == f2->priority)
+			return (f1->inputCount > f2->inputCount);
 		else
 			return (f1->priority > f2->priority);
 	}
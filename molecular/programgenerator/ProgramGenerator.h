@@ -32,17 +32,36 @@ SOFTWARE.
 #include <map>
 #include <molecular/util/Hash.h>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <chrono>
+
+/// Set to 0 to compile out all diagnostic reporting
+#ifndef MOLECULAR_PROGRAMGENERATOR_DIAGNOSTICS
+#define MOLECULAR_PROGRAMGENERATOR_DIAGNOSTICS 1
+#endif
 
 namespace molecular
 {
 namespace programgenerator
 {
 
+class ProgramFile;
+class SnippetLibrary;
+class ProgramCache;
+class SearchPool;
+struct EmbeddedSnippets;
+
 /// Generates shader programs from a given set of inputs and outputs
 class ProgramGenerator
 {
 public:
 	typedef util::Hash Variable;
+	/// Constant and the value, as GLSL expression, a function is specialized for
+	typedef std::pair<Variable, std::string> Specialization;
 
 	/// Information about a variable
 	struct VariableInfo
@@ -72,6 +91,8 @@ public:
 		std::string mOutPrimitive {"points"};
 		/// Maximum number of vertices that will be written by a single invocation of the GS
 		size_t mMaxVertices {1};
+		/// Number of GS invocations per input primitive, each one knows its gl_InvocationID
+		size_t mInvocations {1};
 		/// Description of the primitive for automatic EmitVertex/EndPrimitive declaration
 		/** Each value shows how many vertices should be emitted before each EndPrimitive()*/
 		std::vector<size_t> primitiveDescription;
@@ -79,7 +100,43 @@ public:
 		bool enabled {false};
 		///State variable. Determines if automatic EmitVertex/EndPrimitive is enabled
 		bool mEnableAutoEmission {true};
-		//TODO: add streaming and instancing support
+
+		bool operator==(const GSInfo& other) const
+		{
+			return mInPrimitive == other.mInPrimitive
+					&& mOutPrimitive == other.mOutPrimitive
+					&& mMaxVertices == other.mMaxVertices
+					&& mInvocations == other.mInvocations
+					&& primitiveDescription == other.primitiveDescription
+					&& enabled == other.enabled
+					&& mEnableAutoEmission == other.mEnableAutoEmission;
+		}
+	};
+
+	/// Patch setup shared by the tessellation control and evaluation shaders
+	/** mPatchVertices is taken from tess_control functions, the other values from tess_eval
+		functions. */
+	struct TessInfo
+	{
+		/// Number of vertices in the patch written by the control shader
+		size_t mPatchVertices {3};
+		/// Primitive generated by the tessellator: triangles, quads or isolines
+		std::string mPrimitive {"triangles"};
+		/// Spacing of generated vertices: equal_spacing, fractional_even_spacing or fractional_odd_spacing
+		std::string mSpacing {"equal_spacing"};
+		/// Winding of generated triangles: ccw or cw
+		std::string mOrdering {"ccw"};
+		/// State variable. Determines if tessellation stages are turned on/off
+		bool enabled {false};
+
+		bool operator==(const TessInfo& other) const
+		{
+			return mPatchVertices == other.mPatchVertices
+					&& mPrimitive == other.mPrimitive
+					&& mSpacing == other.mSpacing
+					&& mOrdering == other.mOrdering
+					&& enabled == other.enabled;
+		}
 	};
 
 	/// Information about a function
@@ -91,11 +148,11 @@ public:
 			kVertexStage,
 			kFragmentStage,
 			kGeometryStage,
+			kTessControlStage,
+			kTessEvaluationStage,
 		};
 
 		std::vector<Variable> inputs;
-		/// Input to function mapping, computed during dependency resolution
-		std::map<Variable, Function*> inputFunctions;
 		/// Source code for of the function. 
 		/** For Geometry shader, it is allowed to have multiple body declaration.
 			Generator will append all snippets and correctly generate EndVertex/EndPrimitive 
@@ -113,34 +170,499 @@ public:
 			@see CompareFunctions */
 		int priority = 0;
 
+		/// Cost of the function in arbitrary units, e.g. instructions, or -1 to estimate it
+		/** @see Snippet::cost */
+		int cost = -1;
+
 		/// Simple quality selector
 		bool highQuality = true;
 		
 		/// Determines if this function is pure function
 		bool pureFunction = false;
 
+		/// Constants this function is specialized for, with their values
+		/** The function is only considered if all of them are passed to GenerateProgram() as
+			constants with exactly these values, and is then preferred over unspecialized
+			functions. */
+		std::vector<Specialization> specializations;
+
 		//Geometry shader information
 		std::shared_ptr<GSInfo> gsInfo;
+
+		/// Tessellation setup, only for tessellation stage functions
+		std::shared_ptr<TessInfo> tessInfo;
 		
 		/// For debug purposes
 		std::string name;
 		std::vector<std::string> input_names;
 	};
 
+	/// Index of a variable that has no VariableInfo
+	static const uint32_t kUnknownVariable = 0xffffffff;
+
+	/// Function as stored in a SnippetLibrary
+	/** Strings point into the string pool of the library, so identical strings are stored once.
+		@see Function */
+	struct Snippet
+	{
+		std::vector<Variable> inputs;
+		/// Dense variable indices of inputs, assigned by SnippetLibrary::Freeze()
+		std::vector<uint32_t> inputIndices;
+		std::vector<const std::string*> source;
+		Variable output = 0;
+		/// Dense variable index of output, assigned by SnippetLibrary::Freeze()
+		uint32_t outputIndex = kUnknownVariable;
+		Variable outputArraySizeSource = 0;
+		Function::Stage stage = Function::Stage::kVertexStage;
+		int priority = 0;
+		/// Declared cost, or an estimate from the source
+		/** The estimate counts statements, with extra weight for texture reads and
+			transcendental functions. Bodies of geometry stage functions are added up. */
+		unsigned cost = 0;
+		/// Number of texture reads in the source
+		unsigned textureSamples = 0;
+		bool highQuality = true;
+		bool pureFunction = false;
+		/// Names of the functions called by a pure function, sorted
+		/** Those naming pure functions of the same stage are resolved like inputs, see
+			SnippetLibrary::Freeze(). */
+		std::vector<Variable> calls;
+		std::vector<Specialization> specializations;
+		std::shared_ptr<const GSInfo> gsInfo;
+		std::shared_ptr<const TessInfo> tessInfo;
+		const std::string* name = nullptr;
+	};
+
+	/// Data of a Snippet needed for dependency resolution
+	/** SnippetLibrary::Freeze() stores the records of all functions in one array, grouped by
+		output, and their inputs in another. Resolution reads only these, so each candidate
+		costs about one cache line. Everything else, e.g. source text, stays in the Snippet. */
+	struct SnippetRecord
+	{
+		/// First input, pointing into an array of the library
+		const Variable* inputs;
+		const Snippet* snippet;
+		int32_t priority;
+		Function::Stage stage;
+		uint16_t inputCount;
+		/// Number of source bodies, i.e. vertices of a geometry stage function
+		uint16_t sourceCount;
+		/// Number of Snippet::specializations
+		uint8_t specializationCount;
+		bool highQuality;
+		bool pureFunction;
+
+		const Variable* InputsEnd() const {return inputs + inputCount;}
+	};
+
+	/// Variable as stored in a SnippetLibrary
+	/** @see VariableInfo */
+	struct SnippetVariable
+	{
+		Variable hash = 0;
+		const std::string* name = nullptr;
+		const std::string* type = nullptr;
+		VariableInfo::Usage usage = VariableInfo::Usage::kUniformOrLocal;
+		bool array = false;
+	};
+
+	/// Maps inputs of a snippet to the snippets providing them, computed during dependency resolution
+	typedef std::unordered_map<const Snippet*, std::map<Variable, const Snippet*>> InputFunctionMap;
+
+	ProgramGenerator();
+	/// Create a generator on top of a shared library
+	/** Functions and variables added to this generator are stored in a private overlay. The
+		library itself is never modified.
+		@throws std::invalid_argument if the library is not frozen. */
+	explicit ProgramGenerator(std::shared_ptr<const SnippetLibrary> library);
+	ProgramGenerator(ProgramGenerator&&);
+	ProgramGenerator& operator=(ProgramGenerator&&);
+	~ProgramGenerator();
+
+	/// Variable in the interface of a generated program
+	struct ReflectedVariable
+	{
+		Variable variable = 0;
+		std::string name;
+		std::string type;
+		/// Array size from the arraySizes argument, 0 if the variable is not an array
+		int arraySize = 0;
+		/// Assigned location, -1 unless EmitOptions::explicitLocations is set
+		int location = -1;
+		/// Writing stage for varyings, first stage using it for uniforms and samplers
+		/** With EmitOptions::separable, uniforms and samplers are listed once for each
+			stage using them, since each stage numbers its uniform locations separately. */
+		Function::Stage stage = Function::Stage::kVertexStage;
+	};
+
+	/// Interface of a generated program
+	/** Each list is sorted by name. */
+	struct Reflection
+	{
+		/// Vertex attributes
+		std::vector<ReflectedVariable> attributes;
+		/// Uniforms of non-opaque types
+		std::vector<ReflectedVariable> uniforms;
+		/// Uniforms of opaque types: samplers, images and atomic counters
+		std::vector<ReflectedVariable> samplers;
+		/// Variables passed between stages, including the "vf_" copies of vertex attributes
+		std::vector<ReflectedVariable> varyings;
+		/// Fragment shader outputs
+		std::vector<ReflectedVariable> outputs;
+	};
+
 	/// Output of the program generator
 	struct ProgramText
 	{
 		std::string vertexShader;
 		std::string fragmentShader;
+		/// Empty if no geometry stage function is used
 		std::string geometryShader;
+		/// Empty if no tessellation stage function is used
+		std::string tessControlShader;
+		/// Empty if no tessellation stage function is used
+		std::string tessEvaluationShader;
+		/// Interface of the program, empty for GenerateUberProgram()
+		Reflection reflection;
+		/// Names of the variables captured by GenerateCaptureProgram(), in buffer order
+		/** For glTransformFeedbackVaryings(), unless EmitOptions::captureLayouts is set. */
+		std::vector<std::string> capturedVaryings;
+
+		/// Hash of the text of each stage, 0 for unused stages
+		/** Programs sharing a stage text share its hash, so each unique stage needs to be
+			compiled only once, see FindStage(). With EmitOptions::separable, stages of programs
+			with equal hashes can be combined in program pipelines. */
+		uint64_t vertexShaderHash = 0;
+		uint64_t fragmentShaderHash = 0;
+		uint64_t geometryShaderHash = 0;
+		uint64_t tessControlShaderHash = 0;
+		uint64_t tessEvaluationShaderHash = 0;
+	};
+
+	/// Options for the text of generated programs
+	struct EmitOptions
+	{
+		/// Declare attributes, uniforms, varyings and fragment outputs with layout(location = n)
+		/** Requires GLSL 4.30, or ARB_explicit_uniform_location and ARB_separate_shader_objects. */
+		bool explicitLocations = false;
+		/// Strip comments and redundant whitespace, and shorten the names of local variables
+		/** Names of attributes, uniforms, varyings and outputs are kept. Uber programs are only
+			stripped, since a local of one combination may be a uniform of another. */
+		bool minify = false;
+		/// Emit geometry shader bodies that only differ in the vertex index as a loop
+		/** A function with one body per vertex, like "gs_out.n = gs_in[0].n;" for vertex 0,
+			is then emitted once, indexed by a loop counter. Bodies that differ in any other way
+			are emitted one after another. */
+		bool foldGeometryVertices = false;
+		/// Declare variables captured by GenerateCaptureProgram() with xfb_buffer and xfb_offset
+		/** Requires GLSL 4.40 or ARB_enhanced_layouts. Built-in variables like gl_Position
+			cannot be captured this way. */
+		bool captureLayouts = false;
+		/// Declare the interfaces between stages for separable programs
+		/** Implies explicitLocations, and redeclares the built-in gl_PerVertex blocks. Each
+			stage can then be linked into a program of its own with GL_PROGRAM_SEPARABLE, and
+			used in program pipelines. Uniform locations are numbered separately for each stage,
+			so the text of a stage does not depend on the uniforms of other stages. */
+		bool separable = false;
+	};
+
+	/// Thrown by GenerateProgram() if a requested output cannot be derived from the inputs
+	class UnsatisfiableOutputError : public std::runtime_error
+	{
+	public:
+		UnsatisfiableOutputError(const std::string& what, Variable output, const std::vector<Variable>& missingChain) :
+			std::runtime_error(what), mOutput(output), mMissingChain(missingChain) {}
+
+		/// The requested output that could not be derived
+		Variable GetOutput() const {return mOutput;}
+
+		/// Chain of variables from the output down to the first one that could not be provided
+		/** The last element is neither an input nor the output of any function. If the search
+			failed for other reasons (e.g. stage ordering), the chain only contains the output. */
+		const std::vector<Variable>& GetMissingChain() const {return mMissingChain;}
+
+	private:
+		Variable mOutput;
+		std::vector<Variable> mMissingChain;
+	};
+
+	/// Values of inputs that are known when generating a program, as GLSL expressions
+	typedef std::unordered_map<Variable, std::string> Constants;
+
+	/// Event reported to a DiagnosticSink
+	struct Diagnostic
+	{
+		enum class Level
+		{
+			kDebug,
+			kInfo,
+			kWarning,
+		};
+
+		enum class Event
+		{
+			/// The vertex shader uses none of the inputs
+			kNoVertexInputs,
+			/// An output cannot be derived, variable is the output
+			kUnsatisfiableOutput,
+			/// A function was selected for the program, function is set
+			kFunctionSelected,
+			/// The search was aborted because the SearchBudget was used up
+			kSearchBudgetExceeded,
+		};
+
+		Level level;
+		Event event;
+		/// Variable the event refers to, 0 if none
+		Variable variable;
+		/// Function the event refers to, nullptr if none
+		const Snippet* function;
+	};
+
+	/// Receives diagnostic events from a generator
+	/** Called synchronously on the thread that generates the program. Sinks shared between
+		generators used on different threads must synchronize themselves. */
+	class DiagnosticSink
+	{
+	public:
+		virtual ~DiagnosticSink() {}
+		virtual void Report(const Diagnostic& diagnostic) = 0;
 	};
 
+	/// Deliver events of at least minimumLevel to sink, or nothing if sink is nullptr
+	/** The sink must outlive the generator or be unset before it is destroyed. Nothing is
+		reported if MOLECULAR_PROGRAMGENERATOR_DIAGNOSTICS is 0. */
+	void SetDiagnosticSink(DiagnosticSink* sink, Diagnostic::Level minimumLevel = Diagnostic::Level::kWarning)
+	{
+		mDiagnosticSink = sink;
+		mDiagnosticLevel = minimumLevel;
+	}
+
+	/// Set options for all programs generated afterwards
+	void SetEmitOptions(const EmitOptions& options) {mEmitOptions = options;}
+	const EmitOptions& GetEmitOptions() const {return mEmitOptions;}
+
+	/// Limits of the dependency search for one program
+	struct SearchBudget
+	{
+		/// Maximum number of candidate functions tried, 0 for no limit
+		uint64_t maxSteps = 0;
+		/// Maximum duration of the search, 0 for no limit
+		/** Checked every few hundred steps. */
+		std::chrono::microseconds timeout {0};
+	};
+
+	/// Effort of a dependency search
+	struct SearchStats
+	{
+		/// Candidate functions tried
+		uint64_t steps = 0;
+		std::chrono::microseconds duration {0};
+		/// True if the search was aborted because the budget was used up
+		bool budgetExceeded = false;
+	};
+
+	/// Thrown if the SearchBudget is used up before a program is found
+	/** The search tries candidates in the order of CompareFunctions, so the first program found
+		is the best one. There is no partial result to return. */
+	class SearchBudgetExceededError : public std::runtime_error
+	{
+	public:
+		SearchBudgetExceededError(const std::string& what, const SearchStats& stats) :
+			std::runtime_error(what), mStats(stats) {}
+
+		const SearchStats& GetStats() const {return mStats;}
+
+	private:
+		SearchStats mStats;
+	};
+
+	/// Limit the search of each program generated afterwards
+	void SetSearchBudget(const SearchBudget& budget) {mSearchBudget = budget;}
+	const SearchBudget& GetSearchBudget() const {return mSearchBudget;}
+
+	/// Search alternative functions on up to threads threads, 0 for one per hardware thread
+	/** The calling thread searches together with a pool of threads - 1 workers, which is kept
+		for later requests. Outputs that share no variables are searched at the same time, and
+		whenever the search has to choose between several functions while workers are idle,
+		they try the alternatives. Once a function succeeds, the search of worse ones is
+		cancelled. The result is the same as with one thread, the default. */
+	void SetSearchThreads(unsigned threads) {mSearchThreads = threads;}
+	unsigned GetSearchThreads() const {return mSearchThreads;}
+
+	/// Effort of the last search, zero if the last request was answered from a cache
+	const SearchStats& GetLastSearchStats() const {return mLastSearchStats;}
+
+	/// Look up programs in a persistent cache before generating them, or nothing if cache is nullptr
+	/** Used by GenerateProgram() without a cost report. Entries are keyed on the fingerprint of
+		the snippets, the emit options and the arguments. No diagnostics are reported for programs
+		found in the cache. Programs that cannot be written to the cache are still returned. The
+		cache must outlive the generator or be unset before it is destroyed, and can be shared
+		by several generators. */
+	void SetProgramCache(ProgramCache* cache) {mProgramCache = cache;}
+
+	/// Static cost estimate of one shader of a generated program
+	struct StageCost
+	{
+		Function::Stage stage;
+		/// Functions of the stage in emission order, including pure functions
+		std::vector<const Snippet*> functions;
+		/// Sum of Snippet::cost of functions
+		unsigned cost = 0;
+		/// Sum of Snippet::textureSamples of functions
+		unsigned textureSamples = 0;
+		/// Uniforms used in the stage, not counting constants
+		unsigned uniforms = 0;
+		/// Vertex attributes, only counted for the vertex stage
+		unsigned attributes = 0;
+		/// Variables received from the previous stage
+		unsigned inputVaryings = 0;
+		/// Variables passed to the next stage
+		unsigned outputVaryings = 0;
+	};
+
+	/// Costs of the used stages of a program, in pipeline order
+	typedef std::vector<StageCost> CostReport;
+
 	/// Generate program from separate inputs and outputs
+	/** @param constants Inputs with known values, e.g. {"lightCount"_H, "4"}. They are declared
+			as "const" instead of "uniform", and functions specialized for them are preferred.
+		@param costReport Receives the estimated cost of each stage, may be nullptr.
+		@throws UnsatisfiableOutputError if one of the outputs cannot be derived.
+		@throws std::invalid_argument if a constant is an attribute. */
 	ProgramText GenerateProgram(const std::set<Variable>& inputs,
+			const std::set<Variable>& outputs,
+			const std::unordered_map<Variable, int>& arraySizes = std::unordered_map<Variable, int>(),
+			bool highQuality = true,
+			const Constants& constants = Constants(),
+			CostReport* costReport = nullptr);
+
+	/// Output of GenerateUberProgram()
+	struct UberProgramText
+	{
+		/// Shaders with the code for optional inputs guarded by preprocessor conditionals
+		ProgramText text;
+		/// Preprocessor symbol for each optional input, "HAS_" followed by the variable name
+		/** In the order of the optional inputs. */
+		std::vector<std::string> defines;
+		/// Combinations of defines for which all outputs can be derived
+		/** Each entry lists the symbols to define. All other symbols must stay undefined, since
+			the program is not valid for other combinations. */
+		std::vector<std::vector<std::string>> validCombinations;
+	};
+
+	/// Maximum number of optional inputs of GenerateUberProgram()
+	static const size_t kMaxUberToggles = 6;
+
+	/// Generate one program for all combinations of optional inputs
+	/** Every subset of optionalInputs is resolved together with inputs. Code and declarations
+		that are not needed by all valid subsets are enclosed in #if blocks testing the symbols
+		in UberProgramText::defines, so one program text replaces up to 2^n variants.
+		@throws UnsatisfiableOutputError if the outputs cannot be derived for any combination.
+		@throws std::invalid_argument if there are more than kMaxUberToggles optional inputs.
+		@throws std::runtime_error if combinations disagree on the geometry shader setup or on
+			the order of functions. */
+	UberProgramText GenerateUberProgram(const std::set<Variable>& inputs,
+			const std::set<Variable>& optionalInputs,
 			const std::set<Variable>& outputs,
 			const std::unordered_map<Variable, int>& arraySizes = std::unordered_map<Variable, int>(),
 			bool highQuality = true);
 
+	/// Generate a program that captures variables with transform feedback
+	/** The captured variables are outputs of the last stage before rasterization, and must be
+		computed by that stage. The fragment shader is empty, the program is meant to run with
+		GL_RASTERIZER_DISCARD. Vertices captured once can be drawn many times with a program
+		from GenerateReplayProgram().
+		@param captured Variables in the order of the buffer.
+		@throws UnsatisfiableOutputError if a captured variable cannot be derived.
+		@throws std::invalid_argument if a captured variable is an input or computed by an
+			earlier stage, or if it cannot be declared with EmitOptions::captureLayouts. */
+	ProgramText GenerateCaptureProgram(const std::set<Variable>& inputs,
+			const std::vector<Variable>& captured,
+			const std::unordered_map<Variable, int>& arraySizes = std::unordered_map<Variable, int>(),
+			bool highQuality = true,
+			const Constants& constants = Constants());
+
+	/// Generate a program reading variables captured by GenerateCaptureProgram() as attributes
+	/** Like GenerateProgram(), but the captured variables are vertex attributes instead of
+		being computed by the functions providing them.
+		@throws std::invalid_argument if a captured variable is built-in or read by a stage
+			other than the vertex and fragment stages. */
+	ProgramText GenerateReplayProgram(const std::set<Variable>& inputs,
+			const std::set<Variable>& captured,
+			const std::set<Variable>& outputs,
+			const std::unordered_map<Variable, int>& arraySizes = std::unordered_map<Variable, int>(),
+			bool highQuality = true,
+			const Constants& constants = Constants());
+
+	/// Text of a stage of a program generated before
+	/** Every stage text generated by this generator is stored once, no matter how many
+		programs use it. At most kMaxStages texts are kept.
+		@param hash Hash from ProgramText, e.g. ProgramText::vertexShaderHash.
+		@return nullptr if no stage with the hash is stored. */
+	std::shared_ptr<const std::string> FindStage(uint64_t hash) const;
+	/// Number of unique stage texts stored
+	size_t GetStageCount() const {return mStages.size();}
+	/// Forget all stored stage texts
+	void ClearStages() {mStages.clear();}
+
+	static const size_t kMaxStages = 4096;
+
+	/// Search state of a generated program, opaque
+	struct Resolution;
+
+	/// Program together with the functions it was generated from
+	/** Returned by GenerateIncrementalProgram() and UpdateProgram(). Only valid for the generator
+		that created it. */
+	struct Generation
+	{
+		ProgramText text;
+		std::set<Variable> inputs;
+		std::set<Variable> outputs;
+		std::unordered_map<Variable, int> arraySizes;
+		bool highQuality = true;
+		Constants constants;
+		/// Functions of the program, dependencies first
+		std::vector<const Snippet*> functions;
+		/// Links from each function to the functions providing its inputs
+		InputFunctionMap inputFunctions;
+		/// Shaders whose text differs from the generation this one was updated from
+		/** Lists all used stages for a new generation. Other shaders need not be recompiled. */
+		std::vector<Function::Stage> changedStages;
+
+	private:
+		friend class ProgramGenerator;
+		const ProgramGenerator* mGenerator = nullptr;
+		/// Value of ProgramGenerator::mRevision when generated
+		uint64_t mRevision = 0;
+		std::shared_ptr<const Resolution> mResolution;
+	};
+
+	/// Changes of a request for UpdateProgram()
+	struct ProgramDelta
+	{
+		std::set<Variable> addedInputs;
+		std::set<Variable> removedInputs;
+		std::set<Variable> addedOutputs;
+		std::set<Variable> removedOutputs;
+	};
+
+	/// GenerateProgram(), keeping what is needed to update the program with UpdateProgram()
+	Generation GenerateIncrementalProgram(const std::set<Variable>& inputs,
+			const std::set<Variable>& outputs,
+			const std::unordered_map<Variable, int>& arraySizes = std::unordered_map<Variable, int>(),
+			bool highQuality = true,
+			const Constants& constants = Constants());
+
+	/// Generate a program that differs from a previous one by a few inputs or outputs
+	/** Only variables that can reach a changed input through any of their functions are searched
+		again. Functions chosen for the other variables are kept as long as they remain valid,
+		otherwise the whole request is searched again. If functions or variables were added to
+		the generator since previous was generated, nothing is reused.
+		@throws UnsatisfiableOutputError if one of the outputs cannot be derived.
+		@throws std::invalid_argument if previous was generated by another generator. */
+	Generation UpdateProgram(const Generation& previous, const ProgramDelta& delta);
+
 	/// Generate program from collection of variables (inputs and outputs)
 	/** Variables are sorted first by querying their VariableInfo. */
 	template<class Iterator>
@@ -151,46 +673,174 @@ public:
 
 	/// Add a function to be considered in program generation
 	void AddFunction(const Function &function);
+	void AddFunction(Function&& function);
 	Variable AddVariable(const char* name, const char* type, bool array = false, VariableInfo::Usage usage = VariableInfo::Usage::kUniformOrLocal);
 	Variable AddVariable(const VariableInfo& variable);
+	Variable AddVariable(VariableInfo&& variable);
 
-private:
-	typedef std::unordered_map<Variable, VariableInfo> VariableMap;
-	typedef std::multimap<Variable, Function> FunctionMap;
+	/// Add a range of functions
+	/** Functions are moved if Iterator is a std::move_iterator. */
+	template<class Iterator>
+	void AddFunctions(Iterator begin, Iterator end);
+
+	/// Add a range of variables
+	/** Variables are moved if Iterator is a std::move_iterator. Forward iterators are used to
+		reserve space up front. */
+	template<class Iterator>
+	void AddVariables(Iterator begin, Iterator end);
+
+	/// Add all variables and functions of a parsed file, moving them out of it
+	/** Imported files are added as well, see SnippetLibrary::AddProgramFile(). */
+	void AddProgramFile(ProgramFile&& file);
+	/// Add all variables and functions of a parsed file, e.g. from ProgramFileCache
+	void AddProgramFile(const ProgramFile& file);
+	/// Add snippet files compiled into the program, see EmbeddedSnippets
+	void AddEmbeddedSnippets(const EmbeddedSnippets& snippets);
 
+	/// Reserve space for a number of additional variables
+	void ReserveVariables(size_t count);
+
+private:
 	/// Find alternatives for a given candidate
-	std::vector<ProgramGenerator::Function*> FindCandidateFunctions(const Variable& candidate, bool highQuality);
-	/// Find functions that provide a given output
-	std::vector<ProgramGenerator::Function*> FindFunctions(const std::set<Variable>& inputs, Variable output, bool highQuality, size_t& baseGSAffinity);
+	/** Functions specialized for variables that are not in constants, or for other values, are skipped. */
+	std::vector<const SnippetRecord*> FindCandidateFunctions(const Variable& candidate, const Constants& constants, bool highQuality) const;
+	/// Joint search over all outputs of a program, see ProgramGenerator.cpp
+	class Resolver;
 
+	/// Transform feedback part of a request
+	struct CaptureRequest
+	{
+		/// Captured variables in buffer order
+		std::vector<Variable> variables;
+		/// Read the variables as attributes instead of capturing them
+		bool replay = false;
+	};
 
-	/// Set duplicate functions to nullptr
-	static void RemoveDuplicates(std::vector<Function*>& functions);
+	/// Find functions for all outputs, ordered with dependencies first
+	/** Each variable is provided by one function, shared by all functions using it.
+		@param inputs All inputs, including constants.
+		@throws UnsatisfiableOutputError */
+	std::vector<const Snippet*> ResolveOutputs(const std::set<Variable>& inputs, const Constants& constants, const std::set<Variable>& outputs, bool highQuality, InputFunctionMap& inputFunctions);
+	/// ResolveOutputs() reusing a previous search
+	/** @param resolution Receives the search state, may be nullptr.
+		@param previous Search to reuse choices from, may be nullptr.
+		@param changedInputs Inputs added or removed since previous. */
+	std::vector<const Snippet*> ResolveOutputs(const std::set<Variable>& inputs, const Constants& constants, const std::set<Variable>& outputs, bool highQuality, InputFunctionMap& inputFunctions, Resolution* resolution, const Resolution* previous, const std::set<Variable>& changedInputs);
+
+	/// Shared implementation of GenerateProgram(), GenerateIncrementalProgram(), UpdateProgram(),
+	/// GenerateCaptureProgram() and GenerateReplayProgram()
+	/** @param incremental Fill all members of the Generation, not only the text.
+		@param costReport Receives the estimated cost of each stage, may be nullptr.
+		@param previous Generation to reuse, may be nullptr.
+		@param changedInputs Inputs added or removed since previous.
+		@param capture Transform feedback setup, may be nullptr. */
+	Generation Generate(const std::set<Variable>& inputs,
+			const std::set<Variable>& outputs,
+			const std::unordered_map<Variable, int>& arraySizes,
+			bool highQuality,
+			const Constants& constants,
+			bool incremental,
+			CostReport* costReport,
+			const Generation* previous = nullptr,
+			const std::set<Variable>& changedInputs = std::set<Variable>(),
+			const CaptureRequest* capture = nullptr);
+
+	/// Checks if a variable is declared as program output
+	bool IsOutput(Variable variable) const;
+
+	/// Set the stage hashes of a program and store its stage texts
+	void InternStages(ProgramText& text);
+
+	/// Checks if events of a level reach the sink
+	/** Always false if diagnostics are compiled out, so guarded reports cost nothing. */
+	bool Reports(Diagnostic::Level level) const
+	{
+#if MOLECULAR_PROGRAMGENERATOR_DIAGNOSTICS
+		return mDiagnosticSink && level >= mDiagnosticLevel;
+#else
+		(void)level;
+		return false;
+#endif
+	}
+	/// Deliver an event, only call if Reports() is true
+	void Report(Diagnostic::Level level, Diagnostic::Event event, Variable variable = 0, const Snippet* function = nullptr) const
+	{
+		mDiagnosticSink->Report(Diagnostic{level, event, variable, function});
+	}
 
 	/** Only for debugging. */
-	std::string ToString(const std::set<Variable>& varSet);
+	std::string ToString(const std::set<Variable>& varSet) const;
+	/// Human readable name of a variable, for error messages
+	std::string ToString(Variable variable) const;
 
 	/// Functor that compares two Function objects
 	class CompareFunctions
 	{
 	public:
 		using first_argument_type = bool;
-		using second_argument_type = Function*;
-		using result_type = Function*;
+		using second_argument_type = const SnippetRecord*;
+		using result_type = const SnippetRecord*;
 
 		CompareFunctions(bool highQuality) : mHighQuality(highQuality) {}
-		bool operator() (Function* f1, Function* f2);
+		bool operator() (const SnippetRecord* f1, const SnippetRecord* f2);
 
 	private:
 		bool mHighQuality;
 	};
 
-	/// Maps outputs to functions
-	FunctionMap mFunctions;
-	VariableMap mVariableInfos;
+	/// Request for which ResolveOutputs() found no execution path
+	struct UnsatisfiableRequest
+	{
+		std::set<Variable> inputs;
+		Constants constants;
+		std::set<Variable> outputs;
+		bool highQuality;
+		std::vector<Variable> missingChain;
+	};
+	/// Upper bound for mUnsatisfiableRequests before it is flushed
+	static const size_t kMaxUnsatisfiableRequests = 4096;
+
+	/// Functions and variables of this generator, on top of the shared library if any
+	std::unique_ptr<SnippetLibrary> mSnippets;
 	GSInfo mGeometryShaderInfo;
+	/// Negative result cache, keyed by a hash over all members of UnsatisfiableRequest except missingChain
+	/** Cleared whenever a function is added, since that may make requests satisfiable. */
+	std::unordered_multimap<size_t, UnsatisfiableRequest> mUnsatisfiableRequests;
+	/// Incremented whenever functions or variables are added, invalidating Generation objects
+	uint64_t mRevision = 0;
+	EmitOptions mEmitOptions;
+	SearchBudget mSearchBudget;
+	SearchStats mLastSearchStats;
+	/// Unique stage texts, keyed by hash
+	std::unordered_map<uint64_t, std::shared_ptr<const std::string>> mStages;
+	unsigned mSearchThreads = 1;
+	/// Workers for mSearchThreads > 1, created by the first search using them
+	std::unique_ptr<SearchPool> mSearchPool;
+	ProgramCache* mProgramCache = nullptr;
+	/// SnippetLibrary::GetFingerprint() at mFingerprintRevision
+	uint64_t mFingerprint = 0;
+	uint64_t mFingerprintRevision = ~uint64_t(0);
+	DiagnosticSink* mDiagnosticSink = nullptr;
+	Diagnostic::Level mDiagnosticLevel = Diagnostic::Level::kWarning;
 };
 
+template<class Iterator>
+void ProgramGenerator::AddFunctions(Iterator begin, Iterator end)
+{
+	for(Iterator it = begin; it != end; ++it)
+		AddFunction(*it);
+}
+
+template<class Iterator>
+void ProgramGenerator::AddVariables(Iterator begin, Iterator end)
+{
+	typedef typename std::iterator_traits<Iterator>::iterator_category Category;
+	if(std::is_base_of<std::forward_iterator_tag, Category>::value)
+		ReserveVariables(std::distance(begin, end));
+	for(Iterator it = begin; it != end; ++it)
+		AddVariable(*it);
+}
+
 template<class Iterator>
 ProgramGenerator::ProgramText ProgramGenerator::GenerateProgram(
 		Iterator varsBegin, Iterator varsEnd,
@@ -200,7 +850,7 @@ ProgramGenerator::ProgramText ProgramGenerator::GenerateProgram(
 	std::set<Variable> inputs, outputs;
 	for(Iterator it = varsBegin; it != varsEnd; ++it)
 	{
-		if(mVariableInfos[*it].usage == VariableInfo::Usage::kOutput)
+		if(IsOutput(*it))
 			outputs.insert(*it);
 		else
 			inputs.insert(*it);
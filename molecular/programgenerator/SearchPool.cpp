@@ -0,0 +1,206 @@
+/*	SearchPool.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "SearchPool.h"
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Pool and queue index of the worker running on this thread
+static thread_local const SearchPool* tPool = nullptr;
+static thread_local size_t tQueue = 0;
+
+SearchPool::TaskGroup::~TaskGroup()
+{
+	try
+	{
+		Wait();
+	}
+	catch(...)
+	{
+		// Only reached while unwinding from another exception
+	}
+}
+
+void SearchPool::TaskGroup::Submit(std::function<void()> task)
+{
+	mPending.fetch_add(1);
+	mPool.Push(Task{std::move(task), this});
+}
+
+void SearchPool::TaskGroup::Run(const std::function<void()>& task)
+{
+	try
+	{
+		task();
+	}
+	catch(...)
+	{
+		std::lock_guard<std::mutex> lock(mErrorMutex);
+		if(!mError)
+			mError = std::current_exception();
+	}
+}
+
+void SearchPool::TaskGroup::Wait()
+{
+	const size_t own = mPool.OwnQueue();
+	while(mPending.load(std::memory_order_acquire) != 0)
+	{
+		Task task;
+		if(mPool.Take(own, task))
+			Execute(task);
+		else
+			std::this_thread::yield(); // The remaining tasks are running on other threads
+	}
+
+	std::lock_guard<std::mutex> lock(mErrorMutex);
+	if(mError)
+	{
+		std::exception_ptr error = mError;
+		mError = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void SearchPool::TaskGroup::Finish(std::exception_ptr error)
+{
+	if(error)
+	{
+		std::lock_guard<std::mutex> lock(mErrorMutex);
+		if(!mError)
+			mError = error;
+	}
+	mPending.fetch_sub(1, std::memory_order_release);
+}
+
+SearchPool::SearchPool(unsigned workers) :
+	mQueues(new Queue[workers + 1]),
+	mQueueCount(workers + 1)
+{
+	mThreads.reserve(workers);
+	for(unsigned i = 0; i < workers; i++)
+		mThreads.emplace_back(&SearchPool::Work, this, i);
+}
+
+SearchPool::~SearchPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mCondition.notify_all();
+	for(auto& thread: mThreads)
+		thread.join();
+}
+
+void SearchPool::Work(size_t index)
+{
+	tPool = this;
+	tQueue = index;
+	while(true)
+	{
+		Task task;
+		if(Take(index, task))
+		{
+			Execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mMutex);
+		if(mStopping)
+			return;
+		mIdleWorkers.fetch_add(1, std::memory_order_relaxed);
+		mCondition.wait(lock, [this](){return mStopping || mQueuedTasks.load() != 0;});
+		mIdleWorkers.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+size_t SearchPool::OwnQueue() const
+{
+	return tPool == this ? tQueue : mQueueCount - 1;
+}
+
+void SearchPool::Push(Task task)
+{
+	Queue& queue = mQueues[OwnQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(task));
+	}
+	mQueuedTasks.fetch_add(1);
+	// Taking the mutex orders this with a worker about to sleep
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+	}
+	mCondition.notify_one();
+}
+
+bool SearchPool::Take(size_t own, Task& task)
+{
+	if(mQueuedTasks.load() == 0)
+		return false;
+	for(size_t i = 0; i < mQueueCount; i++)
+	{
+		const size_t index = (own + i) % mQueueCount;
+		Queue& queue = mQueues[index];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if(queue.tasks.empty())
+			continue;
+		if(index == own)
+		{
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		mQueuedTasks.fetch_sub(1);
+		return true;
+	}
+	return false;
+}
+
+void SearchPool::Execute(Task& task)
+{
+	std::exception_ptr error;
+	try
+	{
+		task.function();
+	}
+	catch(...)
+	{
+		error = std::current_exception();
+	}
+	task.function = nullptr; // Release captures before the group may be destroyed
+	task.group->Finish(error);
+}
+
+}
+} // namespace molecular
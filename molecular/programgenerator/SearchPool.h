@@ -0,0 +1,128 @@
+/*	SearchPool.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_SEARCHPOOL_H
+#define MOLECULAR_SEARCHPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Persistent worker threads for parallel searches, see ProgramGenerator::SetSearchThreads()
+/** Each worker has a deque of tasks. Tasks submitted by a worker go to the back of its own
+	deque, and the worker runs them newest first. Idle workers steal the oldest task of other
+	deques. Threads waiting for a TaskGroup run queued tasks meanwhile, so tasks can submit
+	and wait for tasks of their own without blocking a worker. */
+class SearchPool
+{
+public:
+	/// Tasks that are waited for together
+	/** The destructor waits for all tasks, so tasks may refer to locals of the creating scope. */
+	class TaskGroup
+	{
+	public:
+		explicit TaskGroup(SearchPool& pool) : mPool(pool) {}
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+		~TaskGroup();
+
+		/// Queue a task for any thread of the pool
+		void Submit(std::function<void()> task);
+		/// Run a task on the calling thread, keeping its exception like that of a submitted task
+		void Run(const std::function<void()>& task);
+		/// Wait until all tasks finished, running queued tasks meanwhile
+		/** Rethrows the first exception thrown by a task. */
+		void Wait();
+
+	private:
+		friend class SearchPool;
+
+		void Finish(std::exception_ptr error);
+
+		SearchPool& mPool;
+		std::atomic<size_t> mPending {0};
+		std::mutex mErrorMutex;
+		std::exception_ptr mError;
+	};
+
+	explicit SearchPool(unsigned workers);
+	SearchPool(const SearchPool&) = delete;
+	SearchPool& operator=(const SearchPool&) = delete;
+	/// Stops the workers, no TaskGroup may be left
+	~SearchPool();
+
+	unsigned GetWorkerCount() const {return static_cast<unsigned>(mThreads.size());}
+	/// Checks if a worker is waiting for tasks
+	bool HasIdleWorkers() const {return mIdleWorkers.load(std::memory_order_relaxed) != 0;}
+
+private:
+	struct Task
+	{
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void Work(size_t index);
+	/// Queue of the calling thread, the last one for threads outside of the pool
+	size_t OwnQueue() const;
+	void Push(Task task);
+	/// Take the newest task of the own queue, or steal the oldest one of another queue
+	bool Take(size_t own, Task& task);
+	static void Execute(Task& task);
+
+	/// One queue per worker, and one for all other threads
+	std::unique_ptr<Queue[]> mQueues;
+	const size_t mQueueCount;
+	std::vector<std::thread> mThreads;
+	std::atomic<size_t> mQueuedTasks {0};
+	std::atomic<unsigned> mIdleWorkers {0};
+	/// Guards sleeping and waking of idle workers
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	bool mStopping = false;
+};
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_SEARCHPOOL_H
@@ -0,0 +1,172 @@
+/*	ServerProtocol.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "ServerProtocol.h"
+#include "ProgramEncoding.h"
+#include <cstring>
+#include <stdexcept>
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // Not available on macOS, SIGPIPE must be ignored there
+#endif
+#endif
+
+namespace molecular
+{
+namespace programgenerator
+{
+namespace protocol
+{
+
+using encoding::Reader;
+using encoding::Writer;
+
+std::string EncodeRequest(const Request& request)
+{
+	Writer writer;
+	writer.Byte(kVersion);
+	encoding::WriteRequest(writer, request.inputs, request.outputs, request.arraySizes, request.highQuality, request.constants);
+	return std::move(writer.Data());
+}
+
+Request DecodeRequest(const std::string& payload)
+{
+	Reader reader(payload);
+	if(reader.Byte() != kVersion)
+		throw std::runtime_error("Unsupported protocol version");
+	Request request;
+	encoding::ReadRequest(reader, request.inputs, request.outputs, request.arraySizes, request.highQuality, request.constants);
+	reader.Finish();
+	return request;
+}
+
+std::string EncodeResponse(const Response& response)
+{
+	Writer writer;
+	writer.Byte(static_cast<uint8_t>(response.status));
+	if(response.status == Status::kOk)
+		encoding::WriteProgram(writer, response.text);
+	else
+		writer.String(response.error);
+	return std::move(writer.Data());
+}
+
+Response DecodeResponse(const std::string& payload)
+{
+	Reader reader(payload);
+	Response response;
+	uint8_t status = reader.Byte();
+	if(status > static_cast<uint8_t>(Status::kError))
+		throw std::runtime_error("Unknown response status");
+	response.status = static_cast<Status>(status);
+	if(response.status == Status::kOk)
+		encoding::ReadProgram(reader, response.text);
+	else
+		response.error = reader.String();
+	reader.Finish();
+	return response;
+}
+
+#ifndef _WIN32
+
+static bool ReadFully(int socket, char* data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t result = read(socket, data, size);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			return false;
+		data += result;
+		size -= result;
+	}
+	return true;
+}
+
+static bool WriteFully(int socket, const char* data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t result = send(socket, data, size, MSG_NOSIGNAL);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			return false;
+		data += result;
+		size -= result;
+	}
+	return true;
+}
+
+bool ReadMessage(int socket, std::string& payload)
+{
+	unsigned char header[4];
+	if(!ReadFully(socket, reinterpret_cast<char*>(header), 4))
+		return false;
+	uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+	if(size > kMaxMessageSize)
+		return false;
+	payload.resize(size);
+	return ReadFully(socket, &payload[0], size);
+}
+
+bool WriteMessage(int socket, const std::string& payload)
+{
+	const uint32_t size = static_cast<uint32_t>(payload.size());
+	const char header[4] = {char(size), char(size >> 8), char(size >> 16), char(size >> 24)};
+	return WriteFully(socket, header, 4) && WriteFully(socket, payload.data(), payload.size());
+}
+
+Response SendRequest(const std::string& socketPath, const Request& request)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if(socketPath.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("Socket path too long: " + socketPath);
+	std::strcpy(address.sun_path, socketPath.c_str());
+
+	int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if(socket < 0)
+		throw std::runtime_error("Cannot create socket");
+	std::string payload;
+	bool success = connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+			&& WriteMessage(socket, EncodeRequest(request))
+			&& ReadMessage(socket, payload);
+	close(socket);
+	if(!success)
+		throw std::runtime_error("No response from program generator server at " + socketPath);
+	return DecodeResponse(payload);
+}
+
+#endif
+
+}
+}
+} // namespace molecular
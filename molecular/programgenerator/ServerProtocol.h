@@ -0,0 +1,105 @@
+/*	ServerProtocol.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_SERVERPROTOCOL_H
+#define MOLECULAR_SERVERPROTOCOL_H
+
+#include "ProgramGenerator.h"
+#include <string>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Messages between molecular-programgenerator-server and its clients
+/** Each message is a 32 bit payload size followed by the payload. Requests and programs use
+	the encoding of ProgramEncoding.h:
+	@code
+	request message = version (8 bit), request ;
+	response message = status (8 bit), (program | error string) ;
+	@endcode */
+namespace protocol
+{
+
+static const uint8_t kVersion = 2;
+/// Upper bound for payload sizes, larger messages are rejected
+static const uint32_t kMaxMessageSize = 64 << 20;
+
+/// Arguments of ProgramGenerator::GenerateProgram()
+struct Request
+{
+	std::set<ProgramGenerator::Variable> inputs;
+	std::set<ProgramGenerator::Variable> outputs;
+	std::unordered_map<ProgramGenerator::Variable, int> arraySizes;
+	bool highQuality = true;
+	ProgramGenerator::Constants constants;
+};
+
+enum class Status : uint8_t
+{
+	kOk,
+	/// ProgramGenerator::UnsatisfiableOutputError was thrown
+	kUnsatisfiable,
+	/// Any other error, including malformed requests
+	kError,
+};
+
+struct Response
+{
+	Status status = Status::kOk;
+	/// Only set if status is kOk
+	ProgramGenerator::ProgramText text;
+	/// Only set if status is not kOk
+	std::string error;
+};
+
+std::string EncodeRequest(const Request& request);
+/// @throws std::runtime_error if the payload is malformed or of another version.
+Request DecodeRequest(const std::string& payload);
+std::string EncodeResponse(const Response& response);
+/// @throws std::runtime_error if the payload is malformed.
+Response DecodeResponse(const std::string& payload);
+
+#ifndef _WIN32
+/// Read one message from a socket
+/** @return false if the connection was closed or the message is too large. */
+bool ReadMessage(int socket, std::string& payload);
+/// Write one message to a socket
+/** @return false if the connection was closed. */
+bool WriteMessage(int socket, const std::string& payload);
+
+/// Generate a program on a server listening on a Unix domain socket
+/** Opens one connection per call.
+	@throws std::runtime_error if the server cannot be reached. */
+Response SendRequest(const std::string& socketPath, const Request& request);
+#endif
+
+}
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_SERVERPROTOCOL_H
@@ -0,0 +1,601 @@
+/*	SnippetLibrary.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "SnippetLibrary.h"
+#include "ProgramFile.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+namespace molecular
+{
+namespace programgenerator
+{
+using namespace util;
+
+static bool SameGSInfo(const std::shared_ptr<const ProgramGenerator::GSInfo>& a, const std::shared_ptr<const ProgramGenerator::GSInfo>& b)
+{
+	return a == b || (a && b && *a == *b);
+}
+
+static bool SameTessInfo(const std::shared_ptr<const ProgramGenerator::TessInfo>& a, const std::shared_ptr<const ProgramGenerator::TessInfo>& b)
+{
+	return a == b || (a && b && *a == *b);
+}
+
+/// Estimated cost of a texture read, relative to a plain statement
+static const unsigned kTextureSampleCost = 4;
+/// Estimated cost of a transcendental function call, relative to a plain statement
+static const unsigned kTranscendentalCost = 2;
+
+static bool IsIdentifierCharacter(char c)
+{
+	return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+static bool StartsWith(const std::string& string, const char* prefix)
+{
+	return string.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+/// Checks if a called function reads a texture, e.g. texture() or texelFetchOffset()
+static bool IsTextureSample(const std::string& function)
+{
+	if(StartsWith(function, "textureSize") || StartsWith(function, "textureQuery") || function == "textureSamples")
+		return false;
+	return StartsWith(function, "texture") || StartsWith(function, "texelFetch");
+}
+
+static bool IsTranscendental(const std::string& function)
+{
+	static const char* const kFunctions[] = {"pow", "exp", "exp2", "log", "log2", "sqrt", "inversesqrt",
+			"sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh"};
+	for(auto it: kFunctions)
+	{
+		if(function == it)
+			return true;
+	}
+	return false;
+}
+
+/// Estimate the cost of a function body, see ProgramGenerator::Snippet::cost
+/** Comments are skipped. Loops are not taken into account.
+	@param calls Receives the hashes of called functions, may be nullptr. */
+static unsigned EstimateCost(const std::string& source, unsigned& textureSamples, std::vector<ProgramGenerator::Variable>* calls = nullptr)
+{
+	unsigned cost = 0;
+	const size_t size = source.size();
+	for(size_t i = 0; i < size;)
+	{
+		char c = source[i];
+		if(c == '/' && i + 1 < size && source[i + 1] == '/')
+		{
+			i = source.find('\n', i);
+			if(i == std::string::npos)
+				break;
+		}
+		else if(c == '/' && i + 1 < size && source[i + 1] == '*')
+		{
+			i = source.find("*/", i + 2);
+			if(i == std::string::npos)
+				break;
+			i += 2;
+		}
+		else if(std::isalpha(static_cast<unsigned char>(c)) || c == '_')
+		{
+			size_t begin = i;
+			while(i < size && IsIdentifierCharacter(source[i]))
+				i++;
+			size_t next = i;
+			while(next < size && std::isspace(static_cast<unsigned char>(source[next])))
+				next++;
+			if(next == size || source[next] != '(')
+				continue;
+
+			std::string function = source.substr(begin, i - begin);
+			if(calls)
+				calls->push_back(HashUtils::MakeHash(function));
+			if(IsTextureSample(function))
+			{
+				textureSamples++;
+				cost += kTextureSampleCost;
+			}
+			else if(IsTranscendental(function))
+				cost += kTranscendentalCost;
+		}
+		else
+		{
+			if(c == ';')
+				cost++;
+			i++;
+		}
+	}
+	return cost;
+}
+
+/// FNV-1a over the fields of snippets and variables, see SnippetLibrary::GetFingerprint()
+class Fingerprint
+{
+public:
+	void Add(const void* data, size_t size)
+	{
+		for(size_t i = 0; i < size; i++)
+			mHash = (mHash ^ static_cast<const unsigned char*>(data)[i]) * 1099511628211ull;
+	}
+
+	void Add(uint64_t value) {Add(&value, sizeof(value));}
+
+	/// Strings are prefixed by their size, so that adjacent strings cannot be confused
+	void Add(const std::string* string)
+	{
+		Add(string ? string->size() : 0);
+		if(string)
+			Add(string->data(), string->size());
+	}
+
+	template<class T>
+	void Add(const std::vector<T>& values)
+	{
+		Add(values.size());
+		for(auto& value: values)
+			Add(static_cast<uint64_t>(value));
+	}
+
+	void Add(const std::vector<ProgramGenerator::Specialization>& specializations)
+	{
+		Add(specializations.size());
+		for(auto& specialization: specializations)
+		{
+			Add(specialization.first);
+			Add(&specialization.second);
+		}
+	}
+
+	uint64_t Get() const {return mHash;}
+
+private:
+	uint64_t mHash = 14695981039346656037ull;
+};
+
+SnippetLibrary::SnippetLibrary(std::shared_ptr<const SnippetLibrary> base) :
+	mBase(std::move(base))
+{
+}
+
+bool SnippetLibrary::AddFunction(Function&& function)
+{
+	Snippet snippet;
+	snippet.inputs = std::move(function.inputs);
+	snippet.source.reserve(function.source.size());
+	for(auto& source: function.source)
+		snippet.source.push_back(Intern(std::move(source)));
+	snippet.output = function.output;
+	snippet.outputArraySizeSource = function.outputArraySizeSource;
+	snippet.stage = function.stage;
+	snippet.priority = function.priority;
+	for(auto source: snippet.source)
+		snippet.cost += EstimateCost(*source, snippet.textureSamples, function.pureFunction ? &snippet.calls : nullptr);
+	if(function.pureFunction)
+	{
+		// The definition calls itself by name in its signature:
+		std::sort(snippet.calls.begin(), snippet.calls.end());
+		snippet.calls.erase(std::unique(snippet.calls.begin(), snippet.calls.end()), snippet.calls.end());
+		snippet.calls.erase(std::remove(snippet.calls.begin(), snippet.calls.end(), function.output), snippet.calls.end());
+	}
+	if(function.cost >= 0)
+		snippet.cost = function.cost;
+	snippet.highQuality = function.highQuality;
+	snippet.pureFunction = function.pureFunction;
+	snippet.specializations = std::move(function.specializations);
+	snippet.gsInfo = std::move(function.gsInfo);
+	snippet.tessInfo = std::move(function.tessInfo);
+	snippet.name = Intern(std::move(function.name));
+	return AddSnippet(std::move(snippet));
+}
+
+bool SnippetLibrary::AddSnippet(Snippet&& snippet)
+{
+	if(Contains(snippet))
+		return false;
+
+	Variable output = snippet.output;
+	mFunctions.emplace(output, std::move(snippet));
+	mFrozen = false;
+	return true;
+}
+
+SnippetLibrary::Variable SnippetLibrary::AddVariable(VariableInfo&& variable)
+{
+	Variable hash = HashUtils::MakeHash(variable.name);
+	return AddVariable(hash, std::move(variable));
+}
+
+SnippetLibrary::Variable SnippetLibrary::AddVariable(Variable hash, VariableInfo&& variable)
+{
+	const SnippetVariable* oldVar = FindVariable(hash);
+	if(oldVar)
+	{
+		if(*oldVar->name != variable.name)
+			throw(std::runtime_error(std::string("Hash collision between shader variables \"") + *oldVar->name + "\" and \"" + variable.name + "\""));
+		if(*oldVar->type != variable.type)
+			throw(std::runtime_error(std::string("Existing shader variable \"") + variable.name + "\" declared with different type"));
+		if(oldVar->usage != variable.usage)
+			throw(std::runtime_error(std::string("Existing shader variable \"") + variable.name + "\" declared with different usage"));
+		if(oldVar->array == variable.array)
+			return hash; // Nothing new
+	}
+
+	SnippetVariable& info = mVariables[hash];
+	info.hash = hash;
+	info.name = Intern(std::move(variable.name));
+	info.type = Intern(std::move(variable.type));
+	info.usage = variable.usage;
+	info.array = variable.array;
+	mFrozen = false;
+	return hash;
+}
+
+void SnippetLibrary::AddProgramFile(ProgramFile&& file)
+{
+	if(MarkAdded(file))
+		return;
+	AddImports(file);
+
+	auto variables = std::move(file).GetVariables();
+	auto functions = std::move(file).GetFunctions();
+	ReserveVariables(variables.size());
+	for(auto& variable: variables)
+		AddVariable(std::move(variable));
+	for(auto& function: functions)
+		AddFunction(std::move(function));
+}
+
+void SnippetLibrary::AddProgramFile(const ProgramFile& file)
+{
+	if(MarkAdded(file))
+		return;
+	AddImports(file);
+
+	ReserveVariables(file.GetVariables().size());
+	for(auto& variable: file.GetVariables())
+		AddVariable(VariableInfo(variable));
+	for(auto& function: file.GetFunctions())
+		AddFunction(Function(function));
+}
+
+void SnippetLibrary::AddEmbeddedSnippets(const EmbeddedSnippets& snippets)
+{
+	ReserveVariables(snippets.variableCount);
+	for(size_t i = 0; i < snippets.variableCount; i++)
+	{
+		const EmbeddedVariable& variable = snippets.variables[i];
+		AddVariable(variable.hash, VariableInfo(variable.name, variable.type, variable.array, variable.usage));
+	}
+
+	for(size_t i = 0; i < snippets.functionCount; i++)
+	{
+		const EmbeddedFunction& function = snippets.functions[i];
+		Snippet snippet;
+		snippet.inputs.assign(function.inputs, function.inputs + function.inputCount);
+		snippet.source.reserve(function.sourceCount);
+		for(size_t j = 0; j < function.sourceCount; j++)
+			snippet.source.push_back(Intern(function.sources[j]));
+		snippet.output = function.output;
+		snippet.outputArraySizeSource = function.outputArraySizeSource;
+		snippet.stage = function.stage;
+		snippet.priority = function.priority;
+		snippet.cost = function.cost;
+		snippet.textureSamples = function.textureSamples;
+		snippet.highQuality = function.highQuality;
+		snippet.pureFunction = function.pureFunction;
+		snippet.calls.assign(function.calls, function.calls + function.callCount);
+		for(size_t j = 0; j < function.specializationCount; j++)
+			snippet.specializations.push_back(ProgramGenerator::Specialization(function.specializations[j].variable, function.specializations[j].value));
+		if(function.gsInfo)
+		{
+			auto gsInfo = std::make_shared<ProgramGenerator::GSInfo>();
+			gsInfo->mInPrimitive = function.gsInfo->inPrimitive;
+			gsInfo->mOutPrimitive = function.gsInfo->outPrimitive;
+			gsInfo->mMaxVertices = function.gsInfo->maxVertices;
+			gsInfo->mInvocations = function.gsInfo->invocations;
+			gsInfo->primitiveDescription.assign(function.gsInfo->primitiveDescription,
+					function.gsInfo->primitiveDescription + function.gsInfo->primitiveDescriptionCount);
+			gsInfo->mEnableAutoEmission = function.gsInfo->autoEmission;
+			snippet.gsInfo = std::move(gsInfo);
+		}
+		if(function.tessInfo)
+		{
+			auto tessInfo = std::make_shared<ProgramGenerator::TessInfo>();
+			tessInfo->mPatchVertices = function.tessInfo->patchVertices;
+			tessInfo->mPrimitive = function.tessInfo->primitive;
+			tessInfo->mSpacing = function.tessInfo->spacing;
+			tessInfo->mOrdering = function.tessInfo->ordering;
+			snippet.tessInfo = std::move(tessInfo);
+		}
+		snippet.name = Intern(function.name);
+		AddSnippet(std::move(snippet));
+	}
+}
+
+void SnippetLibrary::AddImports(const ProgramFile& file)
+{
+	if(file.GetImportedFiles().size() == file.GetImports().size())
+	{
+		for(auto& imported: file.GetImportedFiles())
+			AddProgramFile(*imported);
+	}
+	else
+	{
+		for(auto& import: file.GetImports())
+			AddProgramFile(*ProgramFileCache::GetInstance().Load(ProgramFileCache::ResolveImport(file.GetPath(), import)));
+	}
+}
+
+bool SnippetLibrary::MarkAdded(const ProgramFile& file)
+{
+	if(file.GetContentHash() == 0)
+		return false; // Not from ProgramFileCache, cannot be identified
+	return !mAddedFiles.insert(std::make_pair(file.GetPath(), file.GetContentHash())).second;
+}
+
+void SnippetLibrary::ReserveVariables(size_t count)
+{
+	mVariables.reserve(mVariables.size() + count);
+}
+
+void SnippetLibrary::FindFunctions(Variable output, std::vector<const Snippet*>& functions) const
+{
+	if(mBase)
+		mBase->FindFunctions(output, functions);
+	auto range = mFunctions.equal_range(output);
+	for(auto it = range.first; it != range.second; ++it)
+		functions.push_back(&it->second);
+}
+
+void SnippetLibrary::FindRecords(Variable output, std::vector<const SnippetRecord*>& records) const
+{
+	if(mBase)
+		mBase->FindRecords(output, records);
+	uint32_t index = mOutputIndex.Find(output);
+	if(index == PerfectHash::kNotFound)
+		return;
+	for(uint32_t i = mRecordOffsets[index]; i < mRecordOffsets[index + 1]; i++)
+		records.push_back(&mRecords[i]);
+}
+
+bool SnippetLibrary::ProvidesOutput(Variable output) const
+{
+	return mFunctions.count(output) || (mBase && mBase->ProvidesOutput(output));
+}
+
+bool SnippetLibrary::ProvidesPureFunction(Variable output, Function::Stage stage) const
+{
+	auto range = mFunctions.equal_range(output);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		if(it->second.pureFunction && it->second.stage == stage)
+			return true;
+	}
+	return mBase && mBase->ProvidesPureFunction(output, stage);
+}
+
+const SnippetLibrary::SnippetVariable* SnippetLibrary::FindVariable(Variable variable) const
+{
+	if(mFrozen)
+	{
+		uint32_t index = mVariableIndex.Find(variable);
+		return index == ProgramGenerator::kUnknownVariable ? nullptr : mVariableTable[index];
+	}
+
+	auto it = mVariables.find(variable);
+	if(it != mVariables.end())
+		return &it->second;
+	return mBase ? mBase->FindVariable(variable) : nullptr;
+}
+
+void SnippetLibrary::Freeze()
+{
+	if(mBase && !mBase->IsFrozen())
+		throw std::invalid_argument("Base of SnippetLibrary is not frozen");
+
+	mVariableTable.clear();
+	if(mBase)
+		mVariableTable = mBase->mVariableTable;
+	mVariableTable.reserve(mVariableTable.size() + mVariables.size());
+
+	std::vector<Variable> keys;
+	keys.reserve(mVariableTable.capacity());
+	for(auto info: mVariableTable)
+		keys.push_back(info->hash);
+
+	for(auto& it: mVariables)
+	{
+		uint32_t baseIndex = mBase ? mBase->FindVariableIndex(it.first) : ProgramGenerator::kUnknownVariable;
+		if(baseIndex != ProgramGenerator::kUnknownVariable)
+			mVariableTable[baseIndex] = &it.second; // Overrides base
+		else
+		{
+			mVariableTable.push_back(&it.second);
+			keys.push_back(it.first);
+		}
+	}
+	mVariableIndex.Build(keys);
+
+	size_t inputCount = 0;
+	for(auto& it: mFunctions)
+	{
+		Snippet& snippet = it.second;
+		snippet.outputIndex = mVariableIndex.Find(snippet.output);
+		snippet.inputIndices.resize(snippet.inputs.size());
+		for(size_t i = 0; i < snippet.inputs.size(); i++)
+			snippet.inputIndices[i] = mVariableIndex.Find(snippet.inputs[i]);
+		inputCount += snippet.inputs.size() + snippet.calls.size();
+	}
+
+	// Records are grouped by output, since mFunctions is sorted by output:
+	mRecords.clear();
+	mRecords.reserve(mFunctions.size());
+	mRecordInputs.clear();
+	mRecordInputs.reserve(inputCount); // Records point into it, so it must not reallocate
+	mRecordOffsets.clear();
+	std::vector<Variable> outputs;
+	for(auto& it: mFunctions)
+	{
+		const Snippet& snippet = it.second;
+		if(outputs.empty() || outputs.back() != snippet.output)
+		{
+			outputs.push_back(snippet.output);
+			mRecordOffsets.push_back(mRecords.size());
+		}
+
+		SnippetRecord record;
+		record.inputs = mRecordInputs.data() + mRecordInputs.size();
+		record.snippet = &snippet;
+		record.priority = snippet.priority;
+		record.stage = snippet.stage;
+		record.sourceCount = snippet.source.size();
+		record.specializationCount = snippet.specializations.size();
+		record.highQuality = snippet.highQuality;
+		record.pureFunction = snippet.pureFunction;
+		mRecordInputs.insert(mRecordInputs.end(), snippet.inputs.begin(), snippet.inputs.end());
+		// Pure functions called by a pure function are resolved like inputs:
+		for(auto call: snippet.calls)
+		{
+			if(ProvidesPureFunction(call, snippet.stage))
+				mRecordInputs.push_back(call);
+		}
+		record.inputCount = mRecordInputs.data() + mRecordInputs.size() - record.inputs;
+		mRecords.push_back(record);
+	}
+	mRecordOffsets.push_back(mRecords.size());
+	mOutputIndex.Build(outputs);
+	mFrozen = true;
+}
+
+const std::string* SnippetLibrary::Intern(std::string&& string)
+{
+	if(mBase)
+	{
+		if(const std::string* existing = mBase->FindString(string))
+			return existing;
+	}
+	return &*mStrings.insert(std::move(string)).first;
+}
+
+const std::string* SnippetLibrary::FindString(const std::string& string) const
+{
+	auto it = mStrings.find(string);
+	if(it != mStrings.end())
+		return &*it;
+	return mBase ? mBase->FindString(string) : nullptr;
+}
+
+uint64_t SnippetLibrary::GetFingerprint() const
+{
+	Fingerprint fingerprint;
+	if(mBase)
+		fingerprint.Add(mBase->GetFingerprint());
+
+	std::vector<const SnippetVariable*> variables;
+	variables.reserve(mVariables.size());
+	for(auto& it: mVariables)
+		variables.push_back(&it.second);
+	std::sort(variables.begin(), variables.end(), [](const SnippetVariable* a, const SnippetVariable* b){return a->hash < b->hash;});
+	for(auto variable: variables)
+	{
+		fingerprint.Add(variable->hash);
+		fingerprint.Add(variable->name);
+		fingerprint.Add(variable->type);
+		fingerprint.Add(static_cast<uint64_t>(variable->usage));
+		fingerprint.Add(variable->array);
+	}
+
+	// Functions of the same output are candidates in this order, so it is part of the fingerprint
+	for(auto& it: mFunctions)
+	{
+		const Snippet& snippet = it.second;
+		fingerprint.Add(snippet.output);
+		fingerprint.Add(snippet.name);
+		fingerprint.Add(snippet.inputs);
+		fingerprint.Add(snippet.source.size());
+		for(auto source: snippet.source)
+			fingerprint.Add(source);
+		fingerprint.Add(snippet.outputArraySizeSource);
+		fingerprint.Add(static_cast<uint64_t>(snippet.stage));
+		fingerprint.Add(static_cast<uint64_t>(snippet.priority));
+		fingerprint.Add(snippet.cost);
+		fingerprint.Add(snippet.highQuality);
+		fingerprint.Add(snippet.pureFunction);
+		fingerprint.Add(snippet.specializations);
+		if(snippet.gsInfo)
+		{
+			const ProgramGenerator::GSInfo& info = *snippet.gsInfo;
+			fingerprint.Add(&info.mInPrimitive);
+			fingerprint.Add(&info.mOutPrimitive);
+			fingerprint.Add(info.mMaxVertices);
+			fingerprint.Add(info.mInvocations);
+			fingerprint.Add(info.primitiveDescription);
+			fingerprint.Add(info.mEnableAutoEmission);
+		}
+		if(snippet.tessInfo)
+		{
+			const ProgramGenerator::TessInfo& info = *snippet.tessInfo;
+			fingerprint.Add(info.mPatchVertices);
+			fingerprint.Add(&info.mPrimitive);
+			fingerprint.Add(&info.mSpacing);
+			fingerprint.Add(&info.mOrdering);
+		}
+	}
+	return fingerprint.Get();
+}
+
+bool SnippetLibrary::Contains(const Snippet& snippet) const
+{
+	// Interned strings can be compared by address
+	auto range = mFunctions.equal_range(snippet.output);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		const Snippet& other = it->second;
+		if(other.source == snippet.source
+				&& other.inputs == snippet.inputs
+				&& other.name == snippet.name
+				&& other.stage == snippet.stage
+				&& other.priority == snippet.priority
+				&& other.cost == snippet.cost
+				&& other.highQuality == snippet.highQuality
+				&& other.pureFunction == snippet.pureFunction
+				&& other.specializations == snippet.specializations
+				&& other.outputArraySizeSource == snippet.outputArraySizeSource
+				&& SameGSInfo(other.gsInfo, snippet.gsInfo)
+				&& SameTessInfo(other.tessInfo, snippet.tessInfo))
+			return true;
+	}
+	return mBase && mBase->Contains(snippet);
+}
+
+}
+} // namespace molecular
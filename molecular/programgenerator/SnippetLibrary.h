@@ -0,0 +1,180 @@
+/*	SnippetLibrary.h
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MOLECULAR_SNIPPETLIBRARY_H
+#define MOLECULAR_SNIPPETLIBRARY_H
+
+#include "ProgramGenerator.h"
+#include "EmbeddedSnippets.h"
+#include "PerfectHash.h"
+#include <unordered_set>
+#include <set>
+
+namespace molecular
+{
+namespace programgenerator
+{
+
+/// Collection of functions and variables that can be shared by several ProgramGenerators
+/** Source bodies, names and types are interned, so each distinct string is stored once. A
+	library can extend a base library: lookups fall through to the base, and strings already
+	present in the base are referenced instead of copied. Identical functions are stored once.
+
+	Fill and freeze a library, then hand it to generators as std::shared_ptr<const SnippetLibrary>.
+	Each generator stores only the functions and variables added to it directly:
+	@code
+	auto library = std::make_shared<SnippetLibrary>();
+	library->AddProgramFile(std::move(programFile));
+	library->Freeze();
+	ProgramGenerator highQuality(library), lowQuality(library);
+	@endcode
+	A library must not be modified while generators use it. */
+class SnippetLibrary
+{
+public:
+	typedef ProgramGenerator::Variable Variable;
+	typedef ProgramGenerator::Function Function;
+	typedef ProgramGenerator::VariableInfo VariableInfo;
+	typedef ProgramGenerator::Snippet Snippet;
+	typedef ProgramGenerator::SnippetRecord SnippetRecord;
+	typedef ProgramGenerator::SnippetVariable SnippetVariable;
+
+	explicit SnippetLibrary(std::shared_ptr<const SnippetLibrary> base = nullptr);
+	SnippetLibrary(const SnippetLibrary&) = delete;
+	SnippetLibrary& operator=(const SnippetLibrary&) = delete;
+
+	/// Add a function
+	/** @returns false if an identical function already exists, either here or in the base. */
+	bool AddFunction(Function&& function);
+
+	/// Add a variable
+	/** @throws std::runtime_error if the variable exists with a different type or usage, or if
+		its name has the same hash as a different variable. */
+	Variable AddVariable(VariableInfo&& variable);
+
+	/// Add all variables and functions of a parsed file, moving them out of it
+	/** Imported files are added first. Each imported file is added only once per library, no
+		matter how many files import it. Imports that were not resolved yet are loaded through
+		ProgramFileCache. */
+	void AddProgramFile(ProgramFile&& file);
+	/// Add all variables and functions of a parsed file, e.g. from ProgramFileCache
+	void AddProgramFile(const ProgramFile& file);
+
+	/// Add all variables and functions of snippet files compiled into the program
+	/** The files are not read or parsed, and variable hashes, costs and calls are taken from
+		the tables. Names, types and sources are still copied into the interned strings of the
+		library, and each function is converted to a Snippet. */
+	void AddEmbeddedSnippets(const EmbeddedSnippets& snippets);
+
+	/// Reserve space for a number of additional variables
+	void ReserveVariables(size_t count);
+
+	/// Append all functions that provide the given output, including those of the base
+	void FindFunctions(Variable output, std::vector<const Snippet*>& functions) const;
+
+	/// Append the records of all functions that provide the given output, including those of the base
+	/** In the same order as FindFunctions(). Only valid while frozen. */
+	void FindRecords(Variable output, std::vector<const SnippetRecord*>& records) const;
+
+	/// Checks if any function provides the given output
+	bool ProvidesOutput(Variable output) const;
+	/// Checks if a pure function of the given stage has the given name
+	bool ProvidesPureFunction(Variable output, Function::Stage stage) const;
+
+	/// Look up a variable here and in the base
+	/** @returns nullptr if the variable is unknown. */
+	const SnippetVariable* FindVariable(Variable variable) const;
+
+	/// Build lookup tables for generation
+	/** Gives every variable, including those of the base, a dense index, and builds a perfect hash
+		table over them. The base keeps its indices, so its snippets remain valid. Snippets get the
+		indices of their inputs and output, and are copied to SnippetRecord arrays. Adding functions
+		or variables afterwards requires calling Freeze() again. Calls of pure functions become
+		inputs of the records, if the base or this library has a pure function of that name in
+		the same stage.
+		@throws std::invalid_argument if the base is not frozen. */
+	void Freeze();
+	bool IsFrozen() const {return mFrozen;}
+
+	/// Dense index of a variable, or ProgramGenerator::kUnknownVariable
+	/** Only valid while frozen. */
+	uint32_t FindVariableIndex(Variable variable) const {return mVariableIndex.Find(variable);}
+	/// Variable by dense index
+	/** Only valid while frozen. */
+	const SnippetVariable& GetVariable(uint32_t index) const {return *mVariableTable[index];}
+	size_t GetVariableCount() const {return mVariableTable.size();}
+
+	const std::shared_ptr<const SnippetLibrary>& GetBase() const {return mBase;}
+
+	/// Hash over all functions and variables, including those of the base
+	/** Libraries with equal fingerprints generate equal programs. Computed on each call. */
+	uint64_t GetFingerprint() const;
+
+private:
+	/// Return pooled copy of a string, from this library or the base
+	const std::string* Intern(std::string&& string);
+	/// Find a pooled string in this library or the base
+	const std::string* FindString(const std::string& string) const;
+
+	/// Checks if an identical snippet exists here or in the base
+	bool Contains(const Snippet& snippet) const;
+	/// Add a snippet unless an identical one exists
+	bool AddSnippet(Snippet&& snippet);
+	/// Add a variable with a known hash
+	Variable AddVariable(Variable hash, VariableInfo&& variable);
+
+	/// Add the files imported by a file
+	void AddImports(const ProgramFile& file);
+	/// Checks if a cached file was added before, and remembers it otherwise
+	bool MarkAdded(const ProgramFile& file);
+
+	std::shared_ptr<const SnippetLibrary> mBase;
+	/// Pool of interned strings. Elements never move, so pointers to them stay valid.
+	std::unordered_set<std::string> mStrings;
+	/// Maps outputs to functions
+	std::multimap<Variable, Snippet> mFunctions;
+	std::unordered_map<Variable, SnippetVariable> mVariables;
+	/// Path and content hash of files added so far
+	std::set<std::pair<std::string, uint64_t>> mAddedFiles;
+
+	/// All variables by dense index, starting with those of the base
+	std::vector<const SnippetVariable*> mVariableTable;
+	/// Maps variables to indices into mVariableTable
+	PerfectHash mVariableIndex;
+	/// Records of mFunctions in the same order, built by Freeze()
+	std::vector<SnippetRecord> mRecords;
+	/// Inputs of all records
+	std::vector<Variable> mRecordInputs;
+	/// Maps outputs to indices into mRecordOffsets
+	PerfectHash mOutputIndex;
+	/// Records of the output with index i are mRecords[mRecordOffsets[i]] to mRecords[mRecordOffsets[i + 1]]
+	std::vector<uint32_t> mRecordOffsets;
+	bool mFrozen = false;
+};
+
+}
+} // namespace molecular
+
+#endif // MOLECULAR_SNIPPETLIBRARY_H
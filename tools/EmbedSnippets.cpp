@@ -0,0 +1,321 @@
+/*	EmbedSnippets.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Converts snippet files to C++ tables at build time, see EmbeddedSnippets.h. Called by the
+	molecular_embed_snippets() CMake function. */
+
+#include <molecular/programgenerator/ProgramFile.h>
+#include <molecular/programgenerator/SnippetLibrary.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+using namespace molecular::programgenerator;
+typedef ProgramGenerator::Variable Variable;
+
+/// Collects outputs and variables of a file and its imports, each file once
+static void CollectVariables(const ProgramFile& file, std::unordered_set<const ProgramFile*>& visited,
+		std::set<Variable>& outputs, std::set<Variable>& variables, std::vector<std::string>& paths)
+{
+	if(!visited.insert(&file).second)
+		return;
+	paths.push_back(file.GetPath());
+	for(auto& imported: file.GetImportedFiles())
+		CollectVariables(*imported, visited, outputs, variables, paths);
+	for(auto& function: file.GetFunctions())
+		outputs.insert(function.output);
+	for(auto& variable: file.GetVariables())
+		variables.insert(molecular::util::HashUtils::MakeHash(variable.name));
+}
+
+/// C++ string literal, one literal per line so that compilers do not hit length limits
+static std::string Literal(const std::string& string)
+{
+	std::ostringstream literal;
+	literal << '"';
+	for(char c: string)
+	{
+		switch(c)
+		{
+		case '"': literal << "\\\""; break;
+		case '\\': literal << "\\\\"; break;
+		case '\t': literal << "\\t"; break;
+		case '\r': literal << "\\r"; break;
+		case '\n': literal << "\\n\"\n\t\t\""; break;
+		default:
+			if(std::isprint(static_cast<unsigned char>(c)))
+				literal << c;
+			else
+				literal << "\\" << std::oct << (static_cast<unsigned>(c) & 0xff) << std::dec << "\"\"";
+		}
+	}
+	literal << '"';
+	return literal.str();
+}
+
+static std::string HashLiteral(Variable hash)
+{
+	std::ostringstream literal;
+	literal << "0x" << std::hex << hash << "u";
+	return literal.str();
+}
+
+/// Array of hashes, returns the expression for its first element
+static std::string WriteHashes(std::ostream& out, const std::string& name, const std::vector<Variable>& hashes)
+{
+	if(hashes.empty())
+		return "nullptr";
+	out << "const ProgramGenerator::Variable " << name << "[] = {";
+	for(size_t i = 0; i < hashes.size(); i++)
+		out << (i ? ", " : "") << HashLiteral(hashes[i]);
+	out << "};\n";
+	return name;
+}
+
+/// Array of specializations, returns the expression for its first element
+static std::string WriteSpecializations(std::ostream& out, const std::string& name, const std::vector<ProgramGenerator::Specialization>& specializations)
+{
+	if(specializations.empty())
+		return "nullptr";
+	out << "const EmbeddedSpecialization " << name << "[] = {";
+	for(size_t i = 0; i < specializations.size(); i++)
+		out << (i ? ", " : "") << "{" << HashLiteral(specializations[i].first) << ", " << Literal(specializations[i].second) << "}";
+	out << "};\n";
+	return name;
+}
+
+static const char* StageName(ProgramGenerator::Function::Stage stage)
+{
+	switch(stage)
+	{
+	case ProgramGenerator::Function::Stage::kVertexStage: return "Stage::kVertexStage";
+	case ProgramGenerator::Function::Stage::kFragmentStage: return "Stage::kFragmentStage";
+	case ProgramGenerator::Function::Stage::kGeometryStage: return "Stage::kGeometryStage";
+	case ProgramGenerator::Function::Stage::kTessControlStage: return "Stage::kTessControlStage";
+	case ProgramGenerator::Function::Stage::kTessEvaluationStage: return "Stage::kTessEvaluationStage";
+	}
+	throw std::invalid_argument("Unknown stage");
+}
+
+static const char* UsageName(ProgramGenerator::VariableInfo::Usage usage)
+{
+	switch(usage)
+	{
+	case ProgramGenerator::VariableInfo::Usage::kUniformOrLocal: return "Usage::kUniformOrLocal";
+	case ProgramGenerator::VariableInfo::Usage::kAttribute: return "Usage::kAttribute";
+	case ProgramGenerator::VariableInfo::Usage::kOutput: return "Usage::kOutput";
+	}
+	throw std::invalid_argument("Unknown usage");
+}
+
+static void WriteSource(std::ostream& out, const std::string& name, const SnippetLibrary& library,
+		const std::set<Variable>& outputs, const std::set<Variable>& variables)
+{
+	out << "#include \"" << name << ".h\"\n\n";
+	out << "namespace\n{\n";
+	out << "using namespace molecular::programgenerator;\n";
+	out << "typedef ProgramGenerator::Function::Stage Stage;\n";
+	out << "typedef ProgramGenerator::VariableInfo::Usage Usage;\n\n";
+
+	// Arrays must not be empty
+	if(!variables.empty())
+	{
+		out << "const EmbeddedVariable kVariables[] = {\n";
+		for(auto hash: variables)
+		{
+			const SnippetLibrary::SnippetVariable* variable = library.FindVariable(hash);
+			out << "\t{" << HashLiteral(hash) << ", " << Literal(*variable->name) << ", " << Literal(*variable->type) << ", "
+					<< UsageName(variable->usage) << ", " << (variable->array ? "true" : "false") << "},\n";
+		}
+		out << "};\n\n";
+	}
+
+	std::ostringstream functions;
+	size_t functionCount = 0;
+	for(auto output: outputs)
+	{
+		std::vector<const ProgramGenerator::Snippet*> snippets;
+		library.FindFunctions(output, snippets);
+		for(const ProgramGenerator::Snippet* snippet: snippets)
+		{
+			const std::string suffix = std::to_string(functionCount++);
+			const std::string inputs = WriteHashes(out, "kInputs" + suffix, snippet->inputs);
+			const std::string specializations = WriteSpecializations(out, "kSpecializations" + suffix, snippet->specializations);
+			const std::string calls = WriteHashes(out, "kCalls" + suffix, snippet->calls);
+			out << "const char* const kSources" << suffix << "[] = {\n";
+			for(auto source: snippet->source)
+				out << "\t" << Literal(*source) << ",\n";
+			out << "};\n";
+
+			std::string gsInfo = "nullptr", tessInfo = "nullptr";
+			if(snippet->gsInfo)
+			{
+				const ProgramGenerator::GSInfo& info = *snippet->gsInfo;
+				std::string description = "nullptr";
+				if(!info.primitiveDescription.empty())
+				{
+					description = "kPrimitiveDescription" + suffix;
+					out << "const size_t " << description << "[] = {";
+					for(size_t i = 0; i < info.primitiveDescription.size(); i++)
+						out << (i ? ", " : "") << info.primitiveDescription[i];
+					out << "};\n";
+				}
+				gsInfo = "&kGSInfo" + suffix;
+				out << "const EmbeddedGSInfo kGSInfo" << suffix << " = {" << Literal(info.mInPrimitive) << ", " << Literal(info.mOutPrimitive)
+						<< ", " << info.mMaxVertices << ", " << info.mInvocations << ", " << description << ", " << info.primitiveDescription.size()
+						<< ", " << (info.mEnableAutoEmission ? "true" : "false") << "};\n";
+			}
+			if(snippet->tessInfo)
+			{
+				const ProgramGenerator::TessInfo& info = *snippet->tessInfo;
+				tessInfo = "&kTessInfo" + suffix;
+				out << "const EmbeddedTessInfo kTessInfo" << suffix << " = {" << info.mPatchVertices << ", " << Literal(info.mPrimitive)
+						<< ", " << Literal(info.mSpacing) << ", " << Literal(info.mOrdering) << "};\n";
+			}
+			out << "\n";
+
+			functions << "\t{" << Literal(*snippet->name) << ", " << HashLiteral(snippet->output) << ", " << HashLiteral(snippet->outputArraySizeSource)
+					<< ", " << StageName(snippet->stage) << ", " << snippet->priority << ", " << snippet->cost << "u, " << snippet->textureSamples << "u"
+					<< ", " << (snippet->highQuality ? "true" : "false") << ", " << (snippet->pureFunction ? "true" : "false")
+					<< ", " << inputs << ", " << snippet->inputs.size()
+					<< ", kSources" << suffix << ", " << snippet->source.size()
+					<< ", " << specializations << ", " << snippet->specializations.size()
+					<< ", " << calls << ", " << snippet->calls.size()
+					<< ", " << gsInfo << ", " << tessInfo << "},\n";
+		}
+	}
+	if(functionCount)
+		out << "const EmbeddedFunction kFunctions[] = {\n" << functions.str() << "};\n";
+	out << "}\n\n";
+
+	out << "extern const EmbeddedSnippets " << name << " = {"
+			<< (variables.empty() ? "nullptr" : "kVariables") << ", " << variables.size() << ", "
+			<< (functionCount ? "kFunctions" : "nullptr") << ", " << functionCount << "};\n";
+}
+
+static void WriteHeader(std::ostream& out, const std::string& name, const std::vector<std::string>& paths)
+{
+	out << "#ifndef MOLECULAR_EMBEDDED_" << name << "_H\n";
+	out << "#define MOLECULAR_EMBEDDED_" << name << "_H\n\n";
+	out << "#include <molecular/programgenerator/EmbeddedSnippets.h>\n\n";
+	out << "/// Snippets of:\n";
+	for(auto& path: paths)
+		out << "/// " << path << "\n";
+	out << "extern const molecular::programgenerator::EmbeddedSnippets " << name << ";\n\n";
+	out << "#endif\n";
+}
+
+/// Write a file, even if its contents did not change
+/** Outputs older than their inputs would make the build system run the tool on every build. */
+static void WriteFile(const std::string& path, const std::string& contents)
+{
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file << contents;
+	if(!file)
+		throw std::runtime_error("Cannot write " + path);
+}
+
+/// Path in a Makefile rule, as read by make and ninja
+static std::string DependencyPath(const std::string& path)
+{
+	std::string escaped;
+	for(char c: path)
+	{
+		if(c == ' ' || c == '#')
+			escaped += '\\';
+		else if(c == '$')
+			escaped += '$';
+		escaped += c;
+	}
+	return escaped;
+}
+
+/// Makefile rule making the outputs depend on all files read, including imported ones
+static void WriteDepfile(std::ostream& out, const std::string& header, const std::string& source, const std::vector<std::string>& paths)
+{
+	out << DependencyPath(header) << " " << DependencyPath(source) << ":";
+	for(auto& path: paths)
+		out << " \\\n  " << DependencyPath(path);
+	out << "\n";
+}
+
+int main(int argc, char** argv)
+{
+	std::string depfile;
+	if(argc > 2 && !strcmp(argv[1], "--depfile"))
+	{
+		depfile = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+	if(argc < 5)
+	{
+		std::cerr << "Usage: molecular-programgenerator-embed [--depfile <depfile>] <name> <header> <source> <snippet file>..." << std::endl;
+		return 1;
+	}
+	const std::string name = argv[1];
+	if(name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))
+			|| !std::all_of(name.begin(), name.end(), [](char c){return std::isalnum(static_cast<unsigned char>(c)) || c == '_';}))
+	{
+		std::cerr << "Name must be a C++ identifier: " << name << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		SnippetLibrary library;
+		std::set<Variable> outputs, variables;
+		std::unordered_set<const ProgramFile*> visited;
+		std::vector<std::string> paths;
+		for(int i = 4; i < argc; i++)
+		{
+			auto file = ProgramFileCache::GetInstance().Load(argv[i]);
+			CollectVariables(*file, visited, outputs, variables, paths);
+			library.AddProgramFile(*file);
+		}
+
+		std::ostringstream header, source;
+		WriteHeader(header, name, paths);
+		WriteSource(source, name, library, outputs, variables);
+		WriteFile(argv[2], header.str());
+		WriteFile(argv[3], source.str());
+		if(!depfile.empty())
+		{
+			std::ostringstream dependencies;
+			WriteDepfile(dependencies, argv[2], argv[3], paths);
+			WriteFile(depfile, dependencies.str());
+		}
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
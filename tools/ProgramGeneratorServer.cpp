@@ -0,0 +1,320 @@
+/*	ProgramGeneratorServer.cpp
+
+MIT License
+
+Copyright (c) 2020 Fabian Herb
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/* Serves ProgramGenerator::GenerateProgram() over a Unix domain socket, so that several processes
+	share one parsed snippet library and one cache of generated programs. See
+	molecular/programgenerator/ServerProtocol.h for the protocol. */
+
+#include <molecular/programgenerator/ProgramFile.h>
+#include <molecular/programgenerator/ServerProtocol.h>
+#include <molecular/programgenerator/SnippetLibrary.h>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace molecular::programgenerator;
+
+/// Generator and result cache shared by all connections
+class Server
+{
+public:
+	explicit Server(std::vector<std::string> files) :
+		mFiles(std::move(files))
+	{
+		Load();
+	}
+
+	/// Handle one request payload, returning the response payload
+	std::string Handle(const std::string& payload);
+
+private:
+	/// Modification time and size of a file
+	typedef std::pair<int64_t, int64_t> FileState;
+
+	/// Parse all files and create a new generator, keeping the old one if parsing fails
+	void Load();
+	/// Reload if a file changed, checked at most once per kCheckInterval
+	void CheckFiles();
+	bool IsCheckDue() const;
+	static FileState GetState(const std::string& path);
+	void Watch(const ProgramFile& file);
+
+	/// Look up a cached response, marking it as most recently used
+	bool FindResponse(const std::string& key, std::string& response);
+	/// Cache a response, evicting the least recently used one if the cache is full
+	void StoreResponse(const std::string& key, const std::string& response);
+	void ClearResponses();
+
+	static const size_t kMaxCachedResponses = 4096;
+	static constexpr std::chrono::seconds kCheckInterval {1};
+
+	const std::vector<std::string> mFiles;
+	/// Guards the generator and the watched files, held while generating
+	std::mutex mGeneratorMutex;
+	std::unique_ptr<ProgramGenerator> mGenerator;
+	/// Files of the library including imports, with their state when loaded
+	std::unordered_map<std::string, FileState> mWatched;
+	/// Time of the last check, in steady_clock ticks
+	std::atomic<std::chrono::steady_clock::rep> mLastCheck {0};
+
+	typedef std::list<std::pair<std::string, std::string>> ResponseList;
+	/// Guards the response cache only, so cached responses are served during a generation
+	/** Taken after mGeneratorMutex if both are needed. */
+	std::mutex mResponsesMutex;
+	/// Pairs of canonically encoded request and response, most recently used first
+	ResponseList mResponses;
+	std::unordered_map<std::string, ResponseList::iterator> mResponseIndex;
+};
+
+constexpr std::chrono::seconds Server::kCheckInterval;
+
+std::string Server::Handle(const std::string& payload)
+{
+	protocol::Response response;
+	try
+	{
+		// Decoding and encoding again gives equal keys for equal requests
+		protocol::Request request = protocol::DecodeRequest(payload);
+		std::string key = protocol::EncodeRequest(request);
+
+		// Cached responses do not wait for a running generation. If files are due for a check
+		// while another request generates, that request checks them afterwards.
+		std::unique_lock<std::mutex> lock(mGeneratorMutex, std::defer_lock);
+		if(IsCheckDue() && lock.try_lock())
+			CheckFiles();
+		std::string cached;
+		if(FindResponse(key, cached))
+			return cached;
+
+		if(!lock.owns_lock())
+		{
+			lock.lock();
+			CheckFiles();
+			// Another request may have generated the same program in the meantime
+			if(FindResponse(key, cached))
+				return cached;
+		}
+
+		try
+		{
+			response.text = mGenerator->GenerateProgram(request.inputs, request.outputs, request.arraySizes, request.highQuality, request.constants);
+		}
+		catch(ProgramGenerator::UnsatisfiableOutputError& e)
+		{
+			response.status = protocol::Status::kUnsatisfiable;
+			response.error = e.what();
+		}
+
+		// Stored while holding the generator, so a reload cannot interleave
+		std::string encoded = protocol::EncodeResponse(response);
+		StoreResponse(key, encoded);
+		return encoded;
+	}
+	catch(std::exception& e)
+	{
+		response.status = protocol::Status::kError;
+		response.error = e.what();
+		return protocol::EncodeResponse(response);
+	}
+}
+
+void Server::Load()
+{
+	auto library = std::make_shared<SnippetLibrary>();
+	std::unordered_map<std::string, FileState> watched;
+	mWatched.swap(watched);
+	try
+	{
+		for(auto& path: mFiles)
+		{
+			auto file = ProgramFileCache::GetInstance().Load(path);
+			library->AddProgramFile(*file);
+			Watch(*file);
+		}
+		library->Freeze();
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Cannot load snippets: " << e.what() << std::endl;
+		if(!mGenerator)
+			throw;
+		// Keep serving the last good library, but notice the next change of any file involved
+		for(auto& it: watched)
+			mWatched[it.first] = GetState(it.first);
+		for(auto& path: mFiles)
+			mWatched[path] = GetState(path);
+		return;
+	}
+
+	mGenerator.reset(new ProgramGenerator(library));
+	ClearResponses();
+	mLastCheck = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+bool Server::IsCheckDue() const
+{
+	const std::chrono::steady_clock::duration sinceCheck(std::chrono::steady_clock::now().time_since_epoch().count() - mLastCheck);
+	return sinceCheck >= kCheckInterval;
+}
+
+void Server::CheckFiles()
+{
+	if(!IsCheckDue())
+		return;
+	mLastCheck = std::chrono::steady_clock::now().time_since_epoch().count();
+
+	for(auto& it: mWatched)
+	{
+		if(GetState(it.first) != it.second)
+		{
+			std::cerr << "Reloading snippets, " << it.first << " changed" << std::endl;
+			Load();
+			return;
+		}
+	}
+}
+
+Server::FileState Server::GetState(const std::string& path)
+{
+	struct stat info;
+	if(stat(path.c_str(), &info) != 0)
+		return FileState(-1, -1);
+	return FileState(info.st_mtime, info.st_size);
+}
+
+bool Server::FindResponse(const std::string& key, std::string& response)
+{
+	std::lock_guard<std::mutex> lock(mResponsesMutex);
+	auto it = mResponseIndex.find(key);
+	if(it == mResponseIndex.end())
+		return false;
+	mResponses.splice(mResponses.begin(), mResponses, it->second);
+	response = it->second->second;
+	return true;
+}
+
+void Server::StoreResponse(const std::string& key, const std::string& response)
+{
+	std::lock_guard<std::mutex> lock(mResponsesMutex);
+	auto it = mResponseIndex.find(key);
+	if(it != mResponseIndex.end())
+	{
+		it->second->second = response;
+		mResponses.splice(mResponses.begin(), mResponses, it->second);
+		return;
+	}
+	if(mResponses.size() >= kMaxCachedResponses)
+	{
+		mResponseIndex.erase(mResponses.back().first);
+		mResponses.pop_back();
+	}
+	mResponses.emplace_front(key, response);
+	mResponseIndex[key] = mResponses.begin();
+}
+
+void Server::ClearResponses()
+{
+	std::lock_guard<std::mutex> lock(mResponsesMutex);
+	mResponses.clear();
+	mResponseIndex.clear();
+}
+
+void Server::Watch(const ProgramFile& file)
+{
+	if(!mWatched.insert(std::make_pair(file.GetPath(), GetState(file.GetPath()))).second)
+		return;
+	for(auto& imported: file.GetImportedFiles())
+		Watch(*imported);
+}
+
+static void Serve(Server& server, int connection)
+{
+	std::string payload;
+	while(protocol::ReadMessage(connection, payload))
+	{
+		if(!protocol::WriteMessage(connection, server.Handle(payload)))
+			break;
+	}
+	close(connection);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <socket path> <snippet file>..." << std::endl;
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	std::unique_ptr<Server> server;
+	try
+	{
+		server.reset(new Server(std::vector<std::string>(argv + 2, argv + argc)));
+	}
+	catch(std::exception&)
+	{
+		return 1; // Reported by Server::Load()
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if(std::strlen(argv[1]) >= sizeof(address.sun_path))
+	{
+		std::cerr << "Socket path too long" << std::endl;
+		return 1;
+	}
+	std::strcpy(address.sun_path, argv[1]);
+	unlink(argv[1]);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0)
+	{
+		std::cerr << "Cannot listen on " << argv[1] << ": " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+
+	while(true)
+	{
+		int connection = accept(listener, nullptr, nullptr);
+		if(connection < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			std::cerr << "accept() failed: " << std::strerror(errno) << std::endl;
+			return 1;
+		}
+		std::thread(Serve, std::ref(*server), connection).detach();
+	}
+}